@@ -1,6 +1,10 @@
 #version 460
 
 layout(location = 0) in vec2 position;
+layout(location = 1) in float radius;
+
+uniform float scale;
+uniform float viewportHeight;
 
 out vec3 VertColor;
 
@@ -9,7 +13,9 @@ vec3 palette(int i) {
 
 }
 void main(void) {
-	gl_Position = vec4(position, 0.0, 1.0);
+	gl_Position = vec4(position * scale, 0.0, 1.0);
+	// Diameter in pixels, the view spans 2 / scale across viewportHeight pixels
+	gl_PointSize = radius * scale * viewportHeight;
 	VertColor = palette(gl_VertexID);
 	// VertColor = vec3(0.0, 0.0, 1.0);
 }
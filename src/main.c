@@ -1,16 +1,30 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <float.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#ifndef NUM_PARTICLES
 #define NUM_PARTICLES (1*8192)
+#endif
+#ifndef INV_RADIUS
 #define INV_RADIUS 128
-#define PARTICLE_RADIUS (1.0f / INV_RADIUS)
+#endif
+#define PARTICLE_RADIUS (1.0f / INV_RADIUS) // largest particle radius, which sizes the grid
 #define MOUSE_FORCE 16.0f
 #define GRAVITY 8.0f
 #define RESTITUTION 0.5f
@@ -18,13 +32,125 @@
 #define SEP_FACTOR 0.49f
 #define FIXED_TIMESTEP 0.0005
 #define DO_COLLISION 1
+#define GRID_INCREMENTAL 0 // move only the particles that changed cell instead of rebuilding the grid
+#define DO_SLEEP 1
+#define SLEEP_VELOCITY (0.01f * PARTICLE_RADIUS) // per-step displacement below which a particle is resting
+#define SLEEP_STEPS 64 // number of steps the resting velocity is averaged over
+#define NEIGHBOUR_SKIN 0.0f // in particle radii, reuse neighbour lists until a particle moves half of it, 0 disables
+#ifndef FIXED_POINT
+#define FIXED_POINT 0 // store positions as 32-bit fixed point, so results don't depend on float rounding
+#endif
+#define FIXED_SHIFT 29 // fraction bits of a fixed-point position, which covers [-4, 4)
+#define FIXED_FRACTION 65536 // scale of the fixed-point solver constants
+
+#define PRECISION_SINGLE 0
+#define PRECISION_DOUBLE 1
+#define PRECISION_MIXED 2 // double positions, float deltas and contact math
+#ifndef PRECISION
+#define PRECISION PRECISION_SINGLE
+#endif
+
+// pos_t stores positions, real_t holds differences of them and the solver's arithmetic
+#if FIXED_POINT
+typedef int32_t pos_t;
+typedef int32_t real_t;
+typedef int64_t motion_t; // squared fixed-point velocity
+#define TO_POS(v) ((pos_t)llrint((double)(v) * (1 << FIXED_SHIFT)))
+#define TO_FLOAT(v) ((float)(v) * (1.0f / (1 << FIXED_SHIFT)))
+#define SLEEP_MOTION ((motion_t)(SLEEP_VELOCITY * (1 << FIXED_SHIFT)) * (motion_t)(SLEEP_VELOCITY * (1 << FIXED_SHIFT)))
+#else
+#if PRECISION == PRECISION_SINGLE
+typedef float pos_t;
+typedef float real_t;
+#define SQRT sqrtf
+#elif PRECISION == PRECISION_DOUBLE
+typedef double pos_t;
+typedef double real_t;
+#define SQRT sqrt
+#else
+typedef double pos_t;
+typedef float real_t;
+#define SQRT sqrtf
+#endif
+typedef float motion_t;
+#define TO_POS(v) (v)
+#define TO_FLOAT(v) ((float)(v))
+#define SLEEP_MOTION (SLEEP_VELOCITY * SLEEP_VELOCITY)
+#endif
 
-#define SUBDIVISIONS 2
-#define NUM_THREADS (1 << SUBDIVISIONS)
+#ifndef COMPACT_STATE
+#define COMPACT_STATE 0 // store prev as a 16-bit velocity relative to curr, 12 instead of 16 bytes per float particle
+#endif
+// Unit of a packed velocity, so 16 bits span one radius of displacement per step
+#if FIXED_POINT
+#define VELOCITY_STEP ((1 << (FIXED_SHIFT - 15)) / INV_RADIUS)
+#else
+#define VELOCITY_STEP (PARTICLE_RADIUS / 32768.0f)
+#endif
+
+#ifndef LOCAL_COORDS
+#define LOCAL_COORDS 0 // store positions relative to their hashed grid cell, so precision doesn't fall with distance
+#endif
+#if LOCAL_COORDS && (FIXED_POINT || PRECISION != PRECISION_SINGLE)
+#error "Cell-relative coordinates need float positions"
+#endif
+
+#define SUBDIVISIONS 2 // threads are 1 << SUBDIVISIONS when the CPUs can't be counted
+#define MAX_SUBDIVISIONS 4 // neighbour list quadrants split into at most 1 << MAX_SUBDIVISIONS regions
+#define MAX_THREADS 256
+#define MAX_NODES 64 // NUMA nodes, one bit each in a node mask
+#ifndef ARENA_HEADROOM
+#define ARENA_HEADROOM 2 // address space reserved per byte of estimated state, for blocks that grow and the holes they leave
+#endif
+#define ARENA_ALIGN 64
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define ARENA_BLOCKS 64
 
-#define GRID_WIDTH INV_RADIUS
-#define GRID_HEIGHT INV_RADIUS
+#ifndef CELL_SIZE
+#define CELL_SIZE 100 // cell edge in percent of a particle diameter
+#endif
+#define GRID_WIDTH (INV_RADIUS * 100 / CELL_SIZE)
+#define GRID_HEIGHT GRID_WIDTH
+#define CELL_EDGE (2.0f / GRID_WIDTH)
+#define CELL_REACH ((GRID_WIDTH + INV_RADIUS - 1) / INV_RADIUS) // cells searched on each side, so touching pairs are always found
 #define CELL_CAP 8
+#ifndef GRID_MORTON
+#define GRID_MORTON 0 // store cells in Z-order so neighbourhoods and thread regions stay compact in memory
+#endif
+#ifndef TILE_WIDTH
+#define TILE_WIDTH 16 // cells per collision tile, sized so the gathered tile stays in L1
+#endif
+#ifndef TILE_HEIGHT
+#define TILE_HEIGHT 4
+#endif
+#ifndef TILE_COLOURS
+#define TILE_COLOURS 4 // 4 or 9, tiles of one colour never share a cell and are resolved in parallel
+#endif
+#if TILE_COLOURS != 4 && TILE_COLOURS != 9
+#error "TILE_COLOURS must be 4 or 9"
+#endif
+// Tiles of one colour gather their cells and CELL_REACH around them, which must never overlap
+#if TILE_COLOURS == 4 && (TILE_WIDTH < 2 * CELL_REACH || TILE_HEIGHT < 2 * CELL_REACH)
+#error "Four tile colours need tiles of at least 2 * CELL_REACH cells per side"
+#endif
+#if TILE_COLOURS == 9 && (TILE_WIDTH < CELL_REACH || TILE_HEIGHT < CELL_REACH)
+#error "Nine tile colours need tiles of at least CELL_REACH cells per side"
+#endif
+#define GRID_MEMORY_BUDGET (16 << 20) // max bytes of cell key storage when growing CELL_CAP
+#define HASH_TILE_SHIFT 2 // hashed grid cells are coloured by tiles of 1 << HASH_TILE_SHIFT cells per side
+#define HASH_MIN_SLOTS 1024
+#define MAX_LEVELS 4 // hierarchical grid levels, the finest holds radii down to PARTICLE_RADIUS / 16
+#define SWEEP_MAX_MOVES 8 // insertion sort moves per particle before the sweep order is radix sorted instead
+#define SWEEP_SLABS 64 // sweep slabs, fixed so the result doesn't depend on the thread count
+#define SWEEP_BATCH 16 // partners whose intervals are tested together
+#define TREE_LEAF_SIZE 8 // particles a quadtree leaf holds before it is split
+#define TREE_MAX_DEPTH 16 // Morton codes carry 16 bits per axis
+#define TREE_MAX_BLOCK_DEPTH 6 // the quadtree is always split into blocks down to here, threads take whole blocks
+#define MAX_CLUSTERS 64
+#define CLUSTER_FRACTION 0.9f // share of the particles spawned in --clusters clumps, the rest is gas
+#if 2 * CELL_REACH > 1 << HASH_TILE_SHIFT
+#error "Hashed grid tiles must be at least 2 * CELL_REACH cells wide"
+#endif
 
 #define RANDOM() (rand() / (float)RAND_MAX)
 #define MAX_INFO_LOG 512
@@ -33,20 +159,641 @@ static float viewport[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
 static float mouse[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
 
 static struct {
-	float curr[NUM_PARTICLES][2];
-	float prev[NUM_PARTICLES][2];
+	pos_t (*curr)[2];
+#if COMPACT_STATE
+	int16_t (*velocity)[2]; // curr - prev in VELOCITY_STEP units
+#else
+	pos_t (*prev)[2];
+#endif
+#if LOCAL_COORDS
+	int32_t (*origin)[2]; // hashed grid cell that curr and prev are relative to
+#endif
+	real_t* radius;
+	int* cell; // grid cell holding the particle, -1 if it was dropped
+	motion_t* motion; // running mean of squared velocity over about SLEEP_STEPS steps
 } particles;
 
 static struct {
-	int keys[CELL_CAP];
-	int count;
-} grid[GRID_HEIGHT][GRID_WIDTH];
+	int* keys; // fixed stride of cap keys per cell
+	int* count;
+	uint16_t* stamp; // generation that last wrote count and active, older cells read as empty
+	uint16_t generation;
+	unsigned char* active; // cell holds a particle that is not resting
+	unsigned char* awake; // cell or one of its neighbours is active
+	uint64_t* occupied; // one bit per cell slot holding at least one particle
+	int* occupiedList; // compact list of the occupied cells
+	int numOccupied;
+	int cap;
+	int cells; // number of cell slots, including the Z-order padding
+} grid;
+
+enum { BROADPHASE_GRID, BROADPHASE_HASH, BROADPHASE_LEVELS, BROADPHASE_SWEEP, BROADPHASE_TREE, BROADPHASE_COUNT };
+
+// A broadphase finds the pairs that may touch and resolves them with collideParticles. Its pairs are
+// split into passes that run one after another, and the threads of one pass never share a particle.
+typedef struct {
+	const char* name;
+	void (*init)(void); // allocate on first use and build for freshly spawned particles
+	void (*build)(void); // once per step before the passes, timed as the update
+	int (*passes)(void);
+	void (*collide)(int pass); // resolve the pairs of one pass on the worker threads
+	void (*printStats)(long steps);
+	int sleeps; // keeps grid.awake up to date, so cells can sleep
+	int bounded; // only covers [-1, 1]
+} broadphase_t;
+
+static struct {
+	int benchSteps; // run headless for this many steps instead of opening a window
+	int warmupSteps; // untimed steps before the benchmark
+	int sleep;
+	int incremental;
+	int broadphase; // BROADPHASE_ backend that finds the pairs
+	int jacobi; // iterations accumulating corrections from a snapshot, 0 resolves pairs in place
+	int threads; // worker threads, 0 uses one per allowed CPU
+	int smt; // also use the SMT siblings of each core
+	int pin; // pin each worker to one CPU
+	float world; // half extent of the walled world, 0 removes the walls
+	float skin;
+	float minRadius; // smallest particle radius in units of PARTICLE_RADIUS
+	float bimodal; // fraction of particles with the smallest radius, 0 draws radii uniformly
+	int clusters; // clumps most particles spawn in, 0 spreads them evenly
+	float gravity;
+	float timestep;
+	unsigned seed;
+} options;
+
+static int sleepingCount;
+static long velocityClamps; // packed velocities that were beyond the 16-bit range
+
+static struct {
+	int* start; // offsets into keys, partners with a higher key only
+	float (*origin)[2]; // positions when the lists were built
+	int* keys;
+	int capacity;
+	int valid;
+	long builds; // rebuilds since the last report
+	long steps;
+} neighbours;
+
+static struct {
+	struct {
+		int x;
+		int y;
+		int count; // 0 marks a free slot
+		int start; // offset into keys
+	}* slots;
+	int size; // power of two, kept at most half full
+	int used;
+	int* usedList;
+	int* keys; // particle keys sorted by slot
+	int passStart[4 * MAX_THREADS + 1]; // offsets into passSlots for each pass and thread
+	int* passSlots;
+	int* bucket; // pass and thread of each used slot while bucketing
+} hashGrid;
 
-pthread_t threads[NUM_THREADS];
-int threadIDs[NUM_THREADS];
-int threadRegion[NUM_THREADS][4];
+static struct {
+	int count; // levels in use, level l has cells 2^l times finer than the grid
+	int* start[MAX_LEVELS]; // offsets into keys per cell, with the end of the last cell after it
+	int* keys; // particle keys sorted by level, then by cell
+	int* cell; // cell of each particle on its own level
+	unsigned char* level; // level of each particle, finer levels hold smaller radius bands
+	int population[MAX_LEVELS];
+} multiGrid;
+
+static struct {
+	int* order; // particle keys sorted by the left edge of their x interval, nearly sorted from the last step
+	float* lo; // x intervals and y intervals in that order
+	float* hi;
+	float* ylo;
+	float* yhi;
+	int* tempOrder; // radix sort buffers
+	float* tempLo;
+	int sorted; // order holds a sorted permutation from an earlier step
+	int slabs;
+	int slabStart[SWEEP_SLABS + 1];
+	long moves; // insertion sort moves since the last report
+	int radixSorts;
+	long candidates; // pairs whose intervals overlap
+} sweep;
+
+static struct {
+	struct {
+		float box[4]; // bounds of the discs below, which may spill over the quadrant: min x, min y, max x, max y
+		int child; // first of four consecutive children, -1 for a leaf
+		int start; // keys below, a contiguous range in Morton order
+		int count;
+	}* nodes; // complete levels down to the blocks, then the split nodes below them
+	int capacity;
+	int used;
+	uint32_t* code; // Morton code of each particle within the bounding square
+	int* keys; // particle keys in Morton order
+	int* tempKeys;
+	int* blockCount; // particles per thread and block, then the scatter offsets
+	int blockDepth; // deep enough that blocks of one colour are more than a contact apart
+	int blocks;
+	float origin[2]; // corner of the bounding square
+	float scale; // codes per unit
+	long candidates; // pairs tested since the last report
+} tree;
+
+static struct {
+	long dropped; // insertions rejected since the last report
+	int peak; // fullest cell of any grid built since the last report
+	int resizes;
+	long moved; // particles that changed cell since the last report
+	long steps;
+	double seconds; // time spent maintaining the grid since the last report
+} gridStats;
+
+pthread_t threads[MAX_THREADS];
+int threadIDs[MAX_THREADS];
+int threadRegion[MAX_THREADS][4];
+int threadCPU[MAX_THREADS]; // logical CPU each thread is pinned to, -1 leaves it free
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t start; // a pass was posted
+	pthread_cond_t done; // the last worker of a pass finished
+	void* (*work)(void*);
+	int workers; // threads taking part in the current pass, the first of the pool
+	int pending; // of those, still running
+	unsigned generation; // passes posted so far
+} pool;
+int numThreads = 1 << SUBDIVISIONS;
 int threadPass = 0;
 
+static struct {
+	int count; // nodes the pinned threads run on, placement is skipped below two
+	int nodes[MAX_NODES]; // those nodes in ascending order, band b of the grid lives on nodes[b]
+	int band[MAX_THREADS]; // band of the node each thread runs on
+	unsigned long mask;
+} numa;
+
+struct {
+	int colour; // tile colour being resolved
+	void (*tile)(int x0, int y0, int x1, int y1); // resolves one tile in the broadphase's own structure
+	int next[MAX_NODES]; // next tile of that colour to hand out, per grid band
+} schedule;
+
+static struct {
+	real_t (*delta)[4]; // per-thread sums of position and previous position corrections, NUM_PARTICLES per thread
+} jacobi;
+
+static struct {
+	char* base;
+	size_t size;
+	size_t used;
+	size_t committed; // bytes from the base that can be touched, the rest is PROT_NONE
+	int hugetlb; // still committing explicit huge pages, cleared once the pool runs out
+	size_t released; // bytes of freed blocks handed back to the kernel
+	size_t high; // highest offset ever handed out, space below it may be dirty
+	size_t page; // granule the kernel releases memory in
+	const char* backing;
+	struct {
+		const char* name;
+		void* addr; // NULL for a free entry
+		size_t bytes;
+	} blocks[ARENA_BLOCKS]; // live blocks, for freeing and the layout report
+	struct {
+		size_t offset;
+		size_t bytes;
+	} holes[2 * ARENA_BLOCKS]; // freed space below used, reused before the arena grows
+	int holeCount;
+} arena;
+
+int commitArena(size_t end) {
+	// Make the reservation usable up to end in huge page steps. Explicit huge pages are mapped while
+	// the pool has them, after that the rest is remapped with normal pages that ask for THP.
+	end = (end + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	if (end <= arena.committed) {
+		return 1;
+	}
+	if (end > arena.size) {
+		return 0;
+	}
+	if (arena.hugetlb) {
+		void* addr = mmap(arena.base + arena.committed, end - arena.committed, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED, -1, 0);
+		if (addr != MAP_FAILED) {
+			arena.committed = end;
+			return 1;
+		}
+		// A failed fixed mapping may have dropped the old one, so put the rest of the reservation back
+		addr = mmap(arena.base + arena.committed, arena.size - arena.committed, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+		if (addr == MAP_FAILED) {
+			return 0;
+		}
+		arena.hugetlb = 0;
+		arena.backing = arena.committed ? "MAP_HUGETLB, then MADV_HUGEPAGE" : "MADV_HUGEPAGE";
+		if (!arena.committed) {
+			arena.page = sysconf(_SC_PAGESIZE);
+		}
+	}
+	if (mprotect(arena.base + arena.committed, end - arena.committed, PROT_READ | PROT_WRITE) != 0) {
+		return 0;
+	}
+	if (madvise(arena.base + arena.committed, end - arena.committed, MADV_HUGEPAGE) != 0 && !arena.committed) {
+		arena.backing = "base pages";
+	}
+	arena.committed = end;
+	return 1;
+}
+
+size_t arenaEstimate(void) {
+	// Largest footprint of the state: per-particle arrays of every backend, the fixed grid at its
+	// memory budget, every level, the hash table and tree pools at their largest, and the lists
+	size_t n = NUM_PARTICLES;
+	size_t bytes = n * (4 * sizeof(*particles.curr) + sizeof(real_t) + sizeof(int) + sizeof(motion_t));
+	bytes += GRID_MEMORY_BUDGET + (size_t)4 * GRID_WIDTH * GRID_HEIGHT * 16;
+	bytes += ((size_t)GRID_WIDTH * GRID_HEIGHT << 2 * MAX_LEVELS) / 3 * sizeof(int) + n * 9;
+	bytes += 8 * n * (sizeof(*hashGrid.slots) + 3 * sizeof(int)) + n * sizeof(int);
+	bytes += n * 7 * sizeof(int);
+	bytes += ((8 << 2 * TREE_MAX_BLOCK_DEPTH) + 8 * n) * sizeof(*tree.nodes) + n * 3 * sizeof(int);
+	bytes += ((size_t)MAX_THREADS << 2 * TREE_MAX_BLOCK_DEPTH) * sizeof(int);
+	// Lists hold up to about (range / radius)^2 partners, with room to double and a copy while they grow
+	float partners = (2.0f * PARTICLE_RADIUS + options.skin) / PARTICLE_RADIUS;
+	bytes += 4 * (size_t)(partners * partners) * n * sizeof(int) + n * sizeof(*neighbours.origin);
+	if (options.jacobi) {
+		bytes += (size_t)numThreads * n * sizeof(*jacobi.delta);
+	}
+	return bytes;
+}
+
+void initArena(void) {
+	// Reserve address space once, aligned to a huge page, sized from the state with some headroom.
+	// Nothing is backed until commitArena makes it accessible, so the reservation is cheap, and if
+	// the address space is limited the reservation is halved down to the bare estimate.
+	size_t need = arenaEstimate();
+	arena.size = (ARENA_HEADROOM * need + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	void* addr;
+	for (;;) {
+		addr = mmap(NULL, arena.size + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (addr != MAP_FAILED) {
+			break;
+		}
+		if (arena.size / 2 < need) {
+			fprintf(stderr, "Failed to reserve %zu MB for the arena!\n", arena.size >> 20);
+			exit(1);
+		}
+		arena.size = (arena.size / 2 + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	}
+	arena.base = (void*)(((uintptr_t)addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+	arena.hugetlb = 1;
+	arena.backing = "MAP_HUGETLB";
+	arena.page = HUGE_PAGE_SIZE;
+	if (!commitArena(HUGE_PAGE_SIZE)) {
+		fprintf(stderr, "Failed to commit the arena!\n");
+		exit(1);
+	}
+}
+
+void addArenaHole(size_t offset, size_t bytes) {
+	if (bytes > 0 && arena.holeCount < 2 * ARENA_BLOCKS) {
+		arena.holes[arena.holeCount].offset = offset;
+		arena.holes[arena.holeCount].bytes = bytes;
+		arena.holeCount++;
+	}
+}
+
+void* arenaAlloc(const char* name, size_t bytes) {
+	// Memory is zeroed: fresh space comes from the kernel, reused space is cleared
+	if (!arena.base) {
+		initArena();
+	}
+	size_t align = bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : ARENA_ALIGN;
+	int b = 0;
+	while (b < ARENA_BLOCKS && arena.blocks[b].addr) {
+		b++;
+	}
+	if (b == ARENA_BLOCKS) {
+		fprintf(stderr, "Arena exhausted allocating %s (%zu bytes)!\n", name, bytes);
+		exit(1);
+	}
+	// First fit among the holes, the rest of the hole stays free
+	size_t offset = 0;
+	int h = 0;
+	while (h < arena.holeCount) {
+		offset = (arena.holes[h].offset + align - 1) & ~(align - 1);
+		if (offset + bytes <= arena.holes[h].offset + arena.holes[h].bytes) {
+			break;
+		}
+		h++;
+	}
+	if (h < arena.holeCount) {
+		size_t start = arena.holes[h].offset;
+		size_t end = start + arena.holes[h].bytes;
+		arena.holes[h] = arena.holes[--arena.holeCount];
+		addArenaHole(start, offset - start);
+		addArenaHole(offset + bytes, end - offset - bytes);
+		memset(arena.base + offset, 0, bytes);
+	} else {
+		offset = (arena.used + align - 1) & ~(align - 1);
+		if (!commitArena(offset + bytes)) {
+			fprintf(stderr, "Arena exhausted allocating %s (%zu bytes)!\n", name, bytes);
+			exit(1);
+		}
+		addArenaHole(arena.used, offset - arena.used);
+		arena.used = offset + bytes;
+		// Space below the high-water mark was handed out before, fresh pages above it are left untouched
+		if (offset < arena.high) {
+			memset(arena.base + offset, 0, (arena.used < arena.high ? arena.used : arena.high) - offset);
+		}
+		if (arena.used > arena.high) {
+			arena.high = arena.used;
+		}
+	}
+	arena.blocks[b].name = name;
+	arena.blocks[b].addr = arena.base + offset;
+	arena.blocks[b].bytes = bytes;
+	return arena.base + offset;
+}
+
+void arenaFree(void* addr) {
+	// The space becomes a hole for later blocks, and the whole pages inside are given back
+	for (int b = 0; b < ARENA_BLOCKS && addr; b++) {
+		if (arena.blocks[b].addr == addr) {
+			uintptr_t start = ((uintptr_t)addr + arena.page - 1) & ~(arena.page - 1);
+			uintptr_t end = ((uintptr_t)addr + arena.blocks[b].bytes) & ~(arena.page - 1);
+			if (end > start && madvise((void*)start, end - start, MADV_DONTNEED) == 0) {
+				arena.released += end - start;
+			}
+			size_t offset = (char*)addr - arena.base;
+			size_t bytes = arena.blocks[b].bytes;
+			arena.blocks[b].addr = NULL;
+			// Merge with neighbouring holes, a hole that reaches the top gives the space back to the bump
+			for (int h = 0; h < arena.holeCount; h++) {
+				if (arena.holes[h].offset + arena.holes[h].bytes == offset || offset + bytes == arena.holes[h].offset) {
+					offset = offset < arena.holes[h].offset ? offset : arena.holes[h].offset;
+					bytes += arena.holes[h].bytes;
+					arena.holes[h] = arena.holes[--arena.holeCount];
+					h = -1;
+				}
+			}
+			if (offset + bytes == arena.used) {
+				arena.used = offset;
+			} else {
+				addArenaHole(offset, bytes);
+			}
+			return;
+		}
+	}
+}
+
+void printArena(void) {
+	size_t live = 0;
+	printf("Arena at %p, %zu MB reserved, backed by %s\n", (void*)arena.base, arena.size >> 20, arena.backing);
+	for (int b = 0; b < ARENA_BLOCKS; b++) {
+		if (arena.blocks[b].addr) {
+			printf("  %-20s +%-12zu %10.1f KB\n", arena.blocks[b].name, (size_t)((char*)arena.blocks[b].addr - arena.base), arena.blocks[b].bytes / 1024.0);
+			live += arena.blocks[b].bytes;
+		}
+	}
+	// Advice can be ignored, so also report how much memory the kernel did back with huge pages
+	long hugeKB = -1;
+	FILE* file = fopen("/proc/self/smaps_rollup", "r");
+	if (file) {
+		char line[128];
+		while (fgets(line, sizeof(line), file)) {
+			if (sscanf(line, "AnonHugePages: %ld", &hugeKB) == 1) {
+				break;
+			}
+		}
+		fclose(file);
+	}
+	printf("Arena: %.1f MB live, %.1f MB span, %.1f MB released, ", live / 1048576.0, arena.used / 1048576.0, arena.released / 1048576.0);
+	if (hugeKB >= 0) {
+		printf("%.1f MB in huge pages\n", hugeKB / 1024.0);
+	} else {
+		printf("huge pages n/a\n");
+	}
+}
+
+size_t particleBytes(void) {
+	// The particle arrays are allocated back to back, so they form one range
+	return (char*)(particles.motion + NUM_PARTICLES) - (char*)particles.curr;
+}
+
+static inline void loadPrev(int i, pos_t prev[2]) {
+#if COMPACT_STATE
+	prev[0] = particles.curr[i][0] - particles.velocity[i][0] * VELOCITY_STEP;
+	prev[1] = particles.curr[i][1] - particles.velocity[i][1] * VELOCITY_STEP;
+#else
+	prev[0] = particles.prev[i][0];
+	prev[1] = particles.prev[i][1];
+#endif
+}
+
+#if COMPACT_STATE
+static inline int16_t packVelocity(real_t v) {
+	// Round to the nearest step, anything faster than a radius per step is clamped and counted
+#if FIXED_POINT
+	real_t q = (v + (v < 0 ? -VELOCITY_STEP / 2 : VELOCITY_STEP / 2)) / VELOCITY_STEP;
+#else
+	real_t q = v * (1.0f / VELOCITY_STEP);
+	q += q < 0.0f ? -0.5f : 0.5f;
+#endif
+	if (q > INT16_MAX || q < -INT16_MAX) {
+		__atomic_fetch_add(&velocityClamps, 1, __ATOMIC_RELAXED);
+		q = q > 0 ? INT16_MAX : -INT16_MAX;
+	}
+	return (int16_t)q;
+}
+#endif
+
+static inline void storePrev(int i, const pos_t prev[2]) {
+	// The compact form is relative to curr, so curr must already hold its new value
+#if COMPACT_STATE
+	particles.velocity[i][0] = packVelocity(particles.curr[i][0] - prev[0]);
+	particles.velocity[i][1] = packVelocity(particles.curr[i][1] - prev[1]);
+#else
+	particles.prev[i][0] = prev[0];
+	particles.prev[i][1] = prev[1];
+#endif
+}
+
+#if LOCAL_COORDS
+static inline void rebaseParticle(int i) {
+	// Anchor the frame to the cell the particle is now in, so local coordinates stay within a cell
+	int shift[2];
+	for (int a = 0; a < 2; a++) {
+		shift[a] = (int)floorf(particles.curr[i][a] * (1.0f / CELL_EDGE));
+	}
+	if (shift[0] || shift[1]) {
+		pos_t prev[2];
+		loadPrev(i, prev);
+		for (int a = 0; a < 2; a++) {
+			particles.origin[i][a] += shift[a];
+			particles.curr[i][a] -= shift[a] * CELL_EDGE;
+			prev[a] -= shift[a] * CELL_EDGE;
+		}
+		storePrev(i, prev);
+	}
+}
+#endif
+
+int readTopology(int cpu, const char* name) {
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	FILE* file = fopen(path, "r");
+	int value = -1;
+	if (file) {
+		if (fscanf(file, "%d", &value) != 1) {
+			value = -1;
+		}
+		fclose(file);
+	}
+	return value;
+}
+
+int cpuNode(int cpu) {
+	// A CPU's directory links to the NUMA node it belongs to
+	for (int node = 0; node < MAX_NODES; node++) {
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+		if (access(path, F_OK) == 0) {
+			return node;
+		}
+	}
+	return 0;
+}
+
+void startThread(int threadID, void* (*start)(void*)) {
+	// Created pinned rather than moved afterwards, so no thread ever runs on the wrong CPU
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (threadCPU[threadID] >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(threadCPU[threadID], &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	threadIDs[threadID] = threadID;
+	pthread_create(&threads[threadID], &attr, start, &threadIDs[threadID]);
+	pthread_attr_destroy(&attr);
+}
+
+void* poolThread(void* arg) {
+	// Workers live for the whole run and sleep between passes
+	int threadID = *(int*)arg;
+	unsigned seen = 0;
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.generation == seen) {
+			pthread_cond_wait(&pool.start, &pool.lock);
+		}
+		seen = pool.generation;
+		if (threadID >= pool.workers) {
+			continue;
+		}
+		void* (*work)(void*) = pool.work;
+		pthread_mutex_unlock(&pool.lock);
+		work(arg);
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.pending == 0) {
+			pthread_cond_signal(&pool.done);
+		}
+	}
+	return NULL;
+}
+
+void startPool(void) {
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.start, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	for (int i = 0; i < numThreads; i++) {
+		startThread(i, poolThread);
+	}
+}
+
+void runWorkers(int count, void* (*work)(void*)) {
+	// Hand one pass to the first count workers and wait until all of them are done
+	pthread_mutex_lock(&pool.lock);
+	pool.work = work;
+	pool.workers = count;
+	pool.pending = count;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	while (pool.pending > 0) {
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void runThreads(void* (*work)(void*)) {
+	runWorkers(numThreads, work);
+}
+
+void setupThreads(void) {
+	// Order the allowed CPUs so the first thread of every physical core comes before any SMT sibling
+	cpu_set_t allowed;
+	int cpus[MAX_THREADS];
+	int numCPUs = 0;
+	int numCores = 0;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		int core[CPU_SETSIZE];
+		int package[CPU_SETSIZE];
+		int taken[CPU_SETSIZE] = { 0 };
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			core[cpu] = CPU_ISSET(cpu, &allowed) ? readTopology(cpu, "core_id") : -1;
+			package[cpu] = CPU_ISSET(cpu, &allowed) ? readTopology(cpu, "physical_package_id") : -1;
+		}
+		for (int sibling = 0; sibling < (options.smt ? 2 : 1); sibling++) {
+			for (int cpu = 0; cpu < CPU_SETSIZE && numCPUs < MAX_THREADS; cpu++) {
+				if (!CPU_ISSET(cpu, &allowed) || taken[cpu]) {
+					continue;
+				}
+				int first = 1;
+				for (int other = 0; other < cpu; other++) {
+					if (core[other] >= 0 && core[other] == core[cpu] && package[other] == package[cpu]) {
+						first = 0;
+						break;
+					}
+				}
+				// Every later sibling of a core is taken in the second round
+				if (first || sibling > 0) {
+					cpus[numCPUs++] = cpu;
+					taken[cpu] = 1;
+					numCores += first;
+				}
+			}
+		}
+	}
+	if (options.threads > 0) {
+		numThreads = options.threads < MAX_THREADS ? options.threads : MAX_THREADS;
+	} else if (numCPUs > 0) {
+		numThreads = numCPUs;
+	}
+	for (int i = 0; i < numThreads; i++) {
+		threadCPU[i] = options.pin && numCPUs > 0 ? cpus[i % numCPUs] : -1;
+	}
+	printf("Running on %d threads (%d cores, %d CPUs used, %s)\n", numThreads, numCores, numCPUs, options.pin ? "pinned" : "not pinned");
+
+	// Memory can only follow threads that stay on one node
+	numa.mask = 0;
+	for (int i = 0; i < numThreads && threadCPU[i] >= 0; i++) {
+		numa.mask |= 1UL << cpuNode(threadCPU[i]);
+	}
+	numa.count = 0;
+	for (int node = 0; node < MAX_NODES; node++) {
+		if (numa.mask >> node & 1) {
+			numa.nodes[numa.count++] = node;
+		}
+	}
+	for (int i = 0; i < numThreads; i++) {
+		int node = threadCPU[i] >= 0 ? cpuNode(threadCPU[i]) : 0;
+		numa.band[i] = 0;
+		for (int b = 0; b < numa.count; b++) {
+			if (numa.nodes[b] == node) {
+				numa.band[i] = b;
+			}
+		}
+	}
+	if (numa.count > 1) {
+		printf("Placing memory on %d NUMA nodes\n", numa.count);
+	}
+	startPool();
+}
+
 // void shuffleParticles(void) {
 // 	for (int i = NUM_PARTICLES - 1; i > 0; i--) {
 // 		int j = rand() % (i + 1);
@@ -65,118 +812,1505 @@ int threadPass = 0;
 // 	}
 // }
 
-void cellAppend(int key, int x, int y) {
-	if (grid[y][x].count >= CELL_CAP) {
-		// fprintf(stderr, "Overfull cell!\n");
-		return;
+float viewExtent(void) {
+	// Half extent of the world shown in the window
+	return options.world > 0.0f ? options.world : 1.0f;
+}
+
+double getSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#if GRID_MORTON
+static int mortonX[GRID_WIDTH];
+static int mortonY[GRID_HEIGHT];
+#endif
+
+static inline unsigned spreadBits(unsigned v) {
+	v &= 0xFFFF;
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+static inline int compactBits(unsigned v) {
+	v &= 0x55555555;
+	v = (v | (v >> 1)) & 0x33333333;
+	v = (v | (v >> 2)) & 0x0F0F0F0F;
+	v = (v | (v >> 4)) & 0x00FF00FF;
+	v = (v | (v >> 8)) & 0x0000FFFF;
+	return v;
+}
+
+static inline int cellIndex(int x, int y) {
+#if GRID_MORTON
+	return mortonX[x] | mortonY[y];
+#else
+	return y * GRID_WIDTH + x;
+#endif
+}
+
+static inline void cellCoords(int c, int* x, int* y) {
+#if GRID_MORTON
+	*x = compactBits(c);
+	*y = compactBits(c >> 1);
+#else
+	*x = c % GRID_WIDTH;
+	*y = c / GRID_WIDTH;
+#endif
+}
+
+static inline int cellOccupied(int c) {
+	return grid.occupied[c >> 6] >> (c & 63) & 1;
+}
+
+static inline void particleCoords(int i, int* cx, int* cy) {
+#if FIXED_POINT
+	// With a power of two grid this is a plain shift
+	int gx = (int)(((int64_t)particles.curr[i][0] + (1 << FIXED_SHIFT)) * GRID_WIDTH >> (FIXED_SHIFT + 1));
+	int gy = (int)(((int64_t)particles.curr[i][1] + (1 << FIXED_SHIFT)) * GRID_HEIGHT >> (FIXED_SHIFT + 1));
+#else
+	float x = particles.curr[i][0];
+	float y = particles.curr[i][1];
+	int gx = (int)((x + 1.0f) * 0.5f * GRID_WIDTH);
+	int gy = (int)((y + 1.0f) * 0.5f * GRID_HEIGHT);
+#endif
+	*cx = gx < 0 ? 0 : gx >= GRID_WIDTH ? GRID_WIDTH - 1 : gx;
+	*cy = gy < 0 ? 0 : gy >= GRID_HEIGHT ? GRID_HEIGHT - 1 : gy;
+}
+
+static inline int particleCell(int i) {
+	int cx, cy;
+	particleCoords(i, &cx, &cy);
+	return cellIndex(cx, cy);
+}
+
+static inline int cellCount(int c) {
+	return grid.stamp[c] == grid.generation ? grid.count[c] : 0;
+}
+
+static inline void cellRefresh(int c) {
+	if (grid.stamp[c] != grid.generation) {
+		grid.stamp[c] = grid.generation;
+		grid.count[c] = 0;
+		grid.active[c] = 0;
+	}
+}
+
+int cellAppend(int key, int c) {
+	cellRefresh(c);
+	if (grid.count[c] >= grid.cap) {
+		return 0;
+	}
+	if (grid.count[c] == 0) {
+		grid.occupied[c >> 6] |= (uint64_t)1 << (c & 63);
+	}
+	grid.keys[c * grid.cap + grid.count[c]++] = key;
+	gridStats.peak = grid.count[c] > gridStats.peak ? grid.count[c] : gridStats.peak;
+	return 1;
+}
+
+void cellRemove(int key, int c) {
+	int* keys = &grid.keys[c * grid.cap];
+	int last = --grid.count[c];
+	if (last == 0) {
+		grid.occupied[c >> 6] &= ~((uint64_t)1 << (c & 63));
+	}
+	for (int ci = 0; ci < last; ci++) {
+		if (keys[ci] == key) {
+			keys[ci] = keys[last];
+			return;
+		}
+	}
+}
+
+void bindMemory(void* addr, size_t bytes, int mode, unsigned long mask) {
+	// Set the NUMA policy of the whole pages in the range and move pages already touched.
+	// Failure only costs locality, so errors are ignored.
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t)addr + bytes) & ~(page - 1);
+	if (end > start) {
+		syscall(SYS_mbind, start, end - start, mode, &mask, MAX_NODES, MPOL_MF_MOVE);
+	}
+}
+
+int gridBandStart(int band) {
+	// First grid row of a band, the grid is cut into one band of rows per node
+	int bands = numa.count > 1 ? numa.count : 1;
+	return band * GRID_HEIGHT / bands;
+}
+
+void placeGrid(void) {
+	// Row-major bands are contiguous, so each node holds the cells of the tiles it resolves first.
+	// Z-order bands are not, so the grid is spread over the nodes instead.
+	if (numa.count < 2) {
+		return;
+	}
+	if (GRID_MORTON) {
+		bindMemory(grid.keys, (size_t)grid.cells * grid.cap * sizeof(int), MPOL_INTERLEAVE, numa.mask);
+		bindMemory(grid.count, grid.cells * sizeof(int), MPOL_INTERLEAVE, numa.mask);
+		return;
+	}
+	for (int b = 0; b < numa.count; b++) {
+		int c0 = gridBandStart(b) * GRID_WIDTH;
+		int c1 = gridBandStart(b + 1) * GRID_WIDTH;
+		bindMemory(grid.keys + (size_t)c0 * grid.cap, (size_t)(c1 - c0) * grid.cap * sizeof(int), MPOL_BIND, 1UL << numa.nodes[b]);
+		bindMemory(grid.count + c0, (c1 - c0) * sizeof(int), MPOL_BIND, 1UL << numa.nodes[b]);
+	}
+}
+
+int resizeGrid(int cap) {
+#if GRID_MORTON
+	for (int x = 0; x < GRID_WIDTH; x++) {
+		mortonX[x] = spreadBits(x);
+	}
+	for (int y = 0; y < GRID_HEIGHT; y++) {
+		mortonY[y] = spreadBits(y) << 1;
+	}
+#endif
+	// Z-order indices grow with both coordinates, so the far corner bounds them
+	grid.cells = cellIndex(GRID_WIDTH - 1, GRID_HEIGHT - 1) + 1;
+	size_t bytes = (size_t)grid.cells * cap * sizeof(int);
+	if (grid.keys && bytes > GRID_MEMORY_BUDGET) {
+		return 0;
+	}
+	arenaFree(grid.keys);
+	grid.keys = arenaAlloc("grid.keys", bytes);
+	if (!grid.count) {
+		grid.count = arenaAlloc("grid.count", grid.cells * sizeof(int));
+		grid.stamp = arenaAlloc("grid.stamp", grid.cells * sizeof(uint16_t));
+		grid.active = arenaAlloc("grid.active", grid.cells);
+		grid.awake = arenaAlloc("grid.awake", grid.cells);
+		memset(grid.awake, 1, grid.cells);
+		grid.occupied = arenaAlloc("grid.occupied", (grid.cells + 63) / 64 * sizeof(uint64_t));
+		grid.occupiedList = arenaAlloc("grid.occupiedList", grid.cells * sizeof(int));
+	}
+	grid.cap = cap;
+	// New key storage means new pages, so the bands are placed again
+	placeGrid();
+	return 1;
+}
+
+void clearActiveCells(void) {
+	// Only cells occupied last step can have been marked, sweep instead once they are dense
+	if (grid.numOccupied > grid.cells / 16) {
+		memset(grid.active, 0, grid.cells);
+		return;
+	}
+	for (int k = 0; k < grid.numOccupied; k++) {
+		grid.active[grid.occupiedList[k]] = 0;
+	}
+}
+
+void collectOccupiedCells(void) {
+	grid.numOccupied = 0;
+	for (int w = 0; w < (grid.cells + 63) / 64; w++) {
+		for (uint64_t bits = grid.occupied[w]; bits; bits &= bits - 1) {
+			grid.occupiedList[grid.numOccupied++] = (w << 6) + __builtin_ctzll(bits);
+		}
+	}
+}
+
+int populateGrid(void) {
+	// Start a new generation instead of clearing the counts, cells not written since read as empty.
+	// When the stamp wraps, all stamps are cleared once so an old one can never pass for current.
+	if (++grid.generation == 0) {
+		memset(grid.stamp, 0, grid.cells * sizeof(uint16_t));
+		grid.generation = 1;
+	}
+	memset(grid.occupied, 0, (grid.cells + 63) / 64 * sizeof(uint64_t));
+	grid.numOccupied = 0;
+
+	int dropped = 0;
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		int c = particleCell(i);
+		int prev = particles.cell[i];
+		cellRefresh(c);
+		if (grid.count[c] == 0) {
+			grid.occupiedList[grid.numOccupied++] = c;
+		}
+		grid.active[c] |= particles.motion[i] >= SLEEP_MOTION;
+		gridStats.moved += c != prev;
+		if (cellAppend(i, c)) {
+			particles.cell[i] = c;
+		} else {
+			particles.cell[i] = -1;
+			dropped++;
+		}
+	}
+	return dropped;
+}
+
+int updateGrid(void) {
+	// Only touch the particles that left their cell since the last step
+	clearActiveCells();
+
+	int dropped = 0;
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		int c = particleCell(i);
+		int prev = particles.cell[i];
+		cellRefresh(c);
+		grid.active[c] |= particles.motion[i] >= SLEEP_MOTION;
+		if (c == prev) {
+			continue;
+		}
+		gridStats.moved++;
+		if (prev >= 0) {
+			cellRemove(i, prev);
+		}
+		if (cellAppend(i, c)) {
+			particles.cell[i] = c;
+		} else {
+			particles.cell[i] = -1;
+			dropped++;
+		}
+	}
+	collectOccupiedCells();
+	return dropped;
+}
+
+void updateAwakeCells(void) {
+	// A cell stays awake while any cell of its neighbourhood is active, only occupied cells are ever asked
+	for (int k = 0; k < grid.numOccupied; k++) {
+		int c = grid.occupiedList[k];
+		int x, y;
+		cellCoords(c, &x, &y);
+		unsigned char awake = !options.sleep;
+		for (int dy = -CELL_REACH; dy <= CELL_REACH; dy++) {
+			for (int dx = -CELL_REACH; dx <= CELL_REACH; dx++) {
+				int nx = x + dx;
+				int ny = y + dy;
+				if (nx >= 0 && nx < GRID_WIDTH && ny >= 0 && ny < GRID_HEIGHT) {
+					int n = cellIndex(nx, ny);
+					awake |= grid.stamp[n] == grid.generation && grid.active[n];
+				}
+			}
+		}
+		grid.awake[c] = awake;
+	}
+}
+
+int neighbourReach(void) {
+	// Cells on each side that can hold a partner within 2 * PARTICLE_RADIUS + skin
+	return (int)ceilf((2.0f * PARTICLE_RADIUS + options.skin) / CELL_EDGE);
+}
+
+void buildNeighbourLists(void) {
+	float range = 2.0f * PARTICLE_RADIUS + options.skin;
+	int reach = neighbourReach();
+	int count = 0;
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		float x = particles.curr[i][0];
+		float y = particles.curr[i][1];
+		neighbours.start[i] = count;
+		neighbours.origin[i][0] = x;
+		neighbours.origin[i][1] = y;
+		int cx, cy;
+		particleCoords(i, &cx, &cy);
+		for (int ny = cy - reach; ny <= cy + reach; ny++) {
+			for (int nx = cx - reach; nx <= cx + reach; nx++) {
+				if (nx < 0 || nx >= GRID_WIDTH || ny < 0 || ny >= GRID_HEIGHT) {
+					continue;
+				}
+				int c = cellIndex(nx, ny);
+				int n = cellCount(c);
+				for (int ci = 0; ci < n; ci++) {
+					int j = grid.keys[c * grid.cap + ci];
+					float dx = particles.curr[j][0] - x;
+					float dy = particles.curr[j][1] - y;
+					if (j <= i || dx * dx + dy * dy > range * range) {
+						continue;
+					}
+					if (count == neighbours.capacity) {
+						int* keys = arenaAlloc("neighbours.keys", 2 * (neighbours.capacity ? neighbours.capacity : 2 * NUM_PARTICLES) * sizeof(int));
+						if (count > 0) {
+							memcpy(keys, neighbours.keys, count * sizeof(int));
+						}
+						arenaFree(neighbours.keys);
+						neighbours.keys = keys;
+						neighbours.capacity = neighbours.capacity ? 2 * neighbours.capacity : 4 * NUM_PARTICLES;
+					}
+					neighbours.keys[count++] = j;
+				}
+			}
+		}
+	}
+	neighbours.start[NUM_PARTICLES] = count;
+	neighbours.valid = 1;
+	neighbours.builds++;
+}
+
+int neighbourListsExpired(void) {
+	float limit = 0.5f * options.skin;
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		float dx = particles.curr[i][0] - neighbours.origin[i][0];
+		float dy = particles.curr[i][1] - neighbours.origin[i][1];
+		if (dx * dx + dy * dy > limit * limit) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static inline int hashCellCoord(float v) {
+	return (int)floorf(v * (0.5f * GRID_WIDTH));
+}
+
+static inline void hashCoords(int i, int* x, int* y) {
+#if LOCAL_COORDS
+	*x = particles.origin[i][0];
+	*y = particles.origin[i][1];
+#else
+	*x = hashCellCoord(particles.curr[i][0]);
+	*y = hashCellCoord(particles.curr[i][1]);
+#endif
+}
+
+static inline unsigned hashCell(int x, int y) {
+	return (unsigned)x * 73856093u ^ (unsigned)y * 19349663u;
+}
+
+int hashFind(int x, int y) {
+	unsigned mask = hashGrid.size - 1;
+	for (unsigned s = hashCell(x, y) & mask;; s = (s + 1) & mask) {
+		if (hashGrid.slots[s].count == 0) {
+			return -1;
+		}
+		if (hashGrid.slots[s].x == x && hashGrid.slots[s].y == y) {
+			return s;
+		}
+	}
+}
+
+int hashInsert(int x, int y) {
+	unsigned mask = hashGrid.size - 1;
+	for (unsigned s = hashCell(x, y) & mask;; s = (s + 1) & mask) {
+		if (hashGrid.slots[s].count == 0) {
+			hashGrid.slots[s].x = x;
+			hashGrid.slots[s].y = y;
+			hashGrid.usedList[hashGrid.used++] = s;
+			return s;
+		}
+		if (hashGrid.slots[s].x == x && hashGrid.slots[s].y == y) {
+			return s;
+		}
+	}
+}
+
+void resizeHashGrid(int size) {
+	arenaFree(hashGrid.slots);
+	arenaFree(hashGrid.usedList);
+	arenaFree(hashGrid.passSlots);
+	arenaFree(hashGrid.bucket);
+	hashGrid.slots = arenaAlloc("hashGrid.slots", size * sizeof(*hashGrid.slots));
+	hashGrid.usedList = arenaAlloc("hashGrid.usedList", size * sizeof(int));
+	hashGrid.passSlots = arenaAlloc("hashGrid.passSlots", size * sizeof(int));
+	hashGrid.bucket = arenaAlloc("hashGrid.bucket", size * sizeof(int));
+	if (!hashGrid.keys) {
+		hashGrid.keys = arenaAlloc("hashGrid.keys", NUM_PARTICLES * sizeof(int));
+	}
+	hashGrid.size = size;
+	hashGrid.used = 0;
+	gridStats.resizes++;
+}
+
+void buildHashGrid(void) {
+	// Size the table for the cells occupied last step, so memory follows occupancy rather than extent.
+	// It grows past a quarter full, but shrinks only to a size still under an eighth full, so a count
+	// wobbling around a boundary doesn't resize every step.
+	int size = HASH_MIN_SLOTS;
+	while (size < 4 * hashGrid.used) {
+		size *= 2;
+	}
+	if (size < hashGrid.size) {
+		size = HASH_MIN_SLOTS;
+		while (size < 8 * hashGrid.used) {
+			size *= 2;
+		}
+	}
+	if (size != hashGrid.size) {
+		resizeHashGrid(size);
+	}
+	for (int k = 0; k < hashGrid.used; k++) {
+		hashGrid.slots[hashGrid.usedList[k]].count = 0;
+	}
+	hashGrid.used = 0;
+
+	// Count particles per cell, growing the table whenever it gets half full
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		if (2 * hashGrid.used >= hashGrid.size) {
+			resizeHashGrid(2 * hashGrid.size);
+			i = -1;
+			continue;
+		}
+		int x, y;
+		hashCoords(i, &x, &y);
+		int s = hashInsert(x, y);
+		hashGrid.slots[s].count++;
+	}
+
+	// Prefix sum, then scatter keys backwards so each start ends up at its first key
+	int offset = 0;
+	for (int k = 0; k < hashGrid.used; k++) {
+		int s = hashGrid.usedList[k];
+		offset += hashGrid.slots[s].count;
+		hashGrid.slots[s].start = offset;
+	}
+	for (int i = NUM_PARTICLES - 1; i >= 0; i--) {
+		int x, y;
+		hashCoords(i, &x, &y);
+		int s = hashFind(x, y);
+		hashGrid.keys[--hashGrid.slots[s].start] = i;
+	}
+
+	// Bucket cells by pass and thread. A pass takes tiles of one parity in x and y, so concurrent
+	// tiles are a whole tile apart. Tiles are spread over threads by hash.
+	memset(hashGrid.passStart, 0, (4 * numThreads + 1) * sizeof(int));
+	for (int k = 0; k < hashGrid.used; k++) {
+		int s = hashGrid.usedList[k];
+		int tx = hashGrid.slots[s].x >> HASH_TILE_SHIFT;
+		int ty = hashGrid.slots[s].y >> HASH_TILE_SHIFT;
+		int bucket = ((tx & 1) | (ty & 1) << 1) * numThreads + hashCell(tx, ty) % numThreads;
+		hashGrid.bucket[k] = bucket;
+		hashGrid.passStart[bucket + 1]++;
+	}
+	for (int b = 0; b < 4 * numThreads; b++) {
+		hashGrid.passStart[b + 1] += hashGrid.passStart[b];
+	}
+	int fill[4 * numThreads];
+	memcpy(fill, hashGrid.passStart, sizeof(fill));
+	for (int k = 0; k < hashGrid.used; k++) {
+		hashGrid.passSlots[fill[hashGrid.bucket[k]]++] = hashGrid.usedList[k];
+	}
+}
+
+void initLevels(void) {
+	// Level l holds radii in (PARTICLE_RADIUS / 2^(l+1), PARTICLE_RADIUS / 2^l], the last one everything smaller
+	if (!multiGrid.keys) {
+		multiGrid.keys = arenaAlloc("multiGrid.keys", NUM_PARTICLES * sizeof(int));
+		multiGrid.cell = arenaAlloc("multiGrid.cell", NUM_PARTICLES * sizeof(int));
+		multiGrid.level = arenaAlloc("multiGrid.level", NUM_PARTICLES);
+	}
+	multiGrid.count = 1;
+	memset(multiGrid.population, 0, sizeof(multiGrid.population));
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		float r = TO_FLOAT(particles.radius[i]);
+		int l = 0;
+		while (l < MAX_LEVELS - 1 && r <= PARTICLE_RADIUS / (2 << l)) {
+			l++;
+		}
+		multiGrid.level[i] = l;
+		multiGrid.population[l]++;
+		multiGrid.count = l + 1 > multiGrid.count ? l + 1 : multiGrid.count;
+	}
+	// Empty levels get no cells, so a bimodal mix only pays for two of them
+	for (int l = 0; l < multiGrid.count; l++) {
+		int width = GRID_WIDTH << l;
+		if (multiGrid.population[l] && !multiGrid.start[l]) {
+			multiGrid.start[l] = arenaAlloc("multiGrid.start", ((size_t)width * width + 1) * sizeof(int));
+		}
+	}
+}
+
+static inline int levelCell(int i, int l) {
+	int width = GRID_WIDTH << l;
+	int gx = (int)((TO_FLOAT(particles.curr[i][0]) + 1.0f) * 0.5f * width);
+	int gy = (int)((TO_FLOAT(particles.curr[i][1]) + 1.0f) * 0.5f * width);
+	gx = gx < 0 ? 0 : gx >= width ? width - 1 : gx;
+	gy = gy < 0 ? 0 : gy >= width ? width - 1 : gy;
+	return gy * width + gx;
+}
+
+void buildLevels(void) {
+	// Counting sort by level and cell, with one prefix sum running through all the levels
+	for (int l = 0; l < multiGrid.count; l++) {
+		if (multiGrid.population[l]) {
+			int width = GRID_WIDTH << l;
+			memset(multiGrid.start[l], 0, ((size_t)width * width + 1) * sizeof(int));
+		}
+	}
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		int l = multiGrid.level[i];
+		int c = levelCell(i, l);
+		multiGrid.cell[i] = c;
+		multiGrid.start[l][c]++;
+	}
+	int offset = 0;
+	for (int l = 0; l < multiGrid.count; l++) {
+		if (!multiGrid.population[l]) {
+			continue;
+		}
+		int cells = (GRID_WIDTH << l) * (GRID_WIDTH << l);
+		int* start = multiGrid.start[l];
+		for (int c = 0; c < cells; c++) {
+			offset += start[c];
+			start[c] = offset;
+		}
+		start[cells] = offset;
+	}
+	// Scatter backwards so each start ends up at its first key
+	for (int i = NUM_PARTICLES - 1; i >= 0; i--) {
+		multiGrid.keys[--multiGrid.start[multiGrid.level[i]][multiGrid.cell[i]]] = i;
+	}
+}
+
+void resetGridStats(void) {
+	gridStats.dropped = 0;
+	gridStats.peak = 0;
+	gridStats.moved = 0;
+	gridStats.steps = 0;
+	gridStats.seconds = 0.0;
+	neighbours.builds = 0;
+	neighbours.steps = 0;
+	sweep.moves = 0;
+	sweep.candidates = 0;
+	sweep.radixSorts = 0;
+	tree.candidates = 0;
+}
+
+void printSweepStats(long steps) {
+	printf("Sweep: %d slabs, %.2f insertion moves and %.1f candidates per particle, %d radix sorts, update %.3f ms/step\n",
+		sweep.slabs, (double)sweep.moves / ((double)steps * NUM_PARTICLES), (double)sweep.candidates / ((double)steps * NUM_PARTICLES),
+		sweep.radixSorts, 1e3 * gridStats.seconds / steps);
+}
+
+void printTreeStats(long steps) {
+	// Walk the tree for its shape, only done when reporting
+	int stack[4 * (TREE_MAX_DEPTH + 1)][2];
+	int n = 0;
+	int leaves = 0;
+	int depth = 0;
+	stack[n][0] = 0;
+	stack[n++][1] = 0;
+	while (n > 0) {
+		n--;
+		int k = stack[n][0];
+		int d = stack[n][1];
+		if (tree.nodes[k].child < 0) {
+			leaves += tree.nodes[k].count > 0;
+			depth = d > depth ? d : depth;
+			continue;
+		}
+		for (int q = 0; q < 4; q++) {
+			stack[n][0] = tree.nodes[k].child + q;
+			stack[n++][1] = d + 1;
+		}
+	}
+	printf("Tree: %d nodes, %d leaves of %.1f particles, depth %d, %dx%d blocks, %.1f candidates per particle, update %.3f ms/step\n",
+		tree.used, leaves, (double)NUM_PARTICLES / (leaves > 0 ? leaves : 1), depth, 1 << tree.blockDepth, 1 << tree.blockDepth,
+		(double)tree.candidates / ((double)steps * NUM_PARTICLES), 1e3 * gridStats.seconds / steps);
+}
+
+void printLevelStats(long steps) {
+	printf("Levels: %d, particles per level", multiGrid.count);
+	for (int l = 0; l < multiGrid.count; l++) {
+		printf(" %d", multiGrid.population[l]);
+	}
+	printf(", update %.3f ms/step\n", 1e3 * gridStats.seconds / steps);
+}
+
+void printHashStats(long steps) {
+	size_t bytes = hashGrid.size * (sizeof(*hashGrid.slots) + 3 * sizeof(int)) + NUM_PARTICLES * sizeof(int);
+	printf("Hash grid: %d cells in %d slots (%.1f KB), resizes %d, update %.3f ms/step\n",
+		hashGrid.used, hashGrid.size, bytes / 1024.0, gridStats.resizes, 1e3 * gridStats.seconds / steps);
+}
+
+void printFixedGridStats(long steps) {
+	// Histogram of cell occupancy in the current grid, 0 to cap. The peak covers every step since the last report.
+	int histogram[grid.cap + 1];
+	memset(histogram, 0, sizeof(histogram));
+	for (int c = 0; c < grid.cells; c++) {
+		histogram[cellCount(c)]++;
+	}
+	printf("Grid: cap %d, peak %d, dropped %ld, resizes %d, moved %.2f%%, update %.3f ms/step, occupancy",
+		grid.cap, gridStats.peak, gridStats.dropped, gridStats.resizes,
+		100.0 * gridStats.moved / ((double)steps * NUM_PARTICLES), 1e3 * gridStats.seconds / steps);
+	for (int n = 0; n <= grid.cap; n++) {
+		if (histogram[n] > 0) {
+			printf(" %d:%d", n, histogram[n]);
+		}
+	}
+	printf("\n");
+	if (options.skin > 0.0f) {
+		long builds = neighbours.builds > 0 ? neighbours.builds : 1;
+		printf("Neighbour lists: rebuilt every %.1f steps, %.1f partners per particle\n",
+			(double)neighbours.steps / builds, (double)neighbours.start[NUM_PARTICLES] / NUM_PARTICLES);
+	}
+}
+
+#if FIXED_POINT
+static inline int64_t isqrt64(int64_t v) {
+	// Floor of the square root, exact however the estimate was rounded
+	int64_t r = (int64_t)sqrt((double)v);
+	while (r * r > v) {
+		r--;
+	}
+	while ((r + 1) * (r + 1) <= v) {
+		r++;
+	}
+	return r;
+}
+
+static inline int contactCorrection(const pos_t* curr1, const pos_t* prev1, const pos_t* curr2, const pos_t* prev2, real_t radii, real_t d[4]) {
+	// Same contact as the float solver in integer arithmetic only
+	int64_t dx = (int64_t)curr1[0] - curr2[0];
+	int64_t dy = (int64_t)curr1[1] - curr2[1];
+	int64_t rsum = radii;
+	int64_t dist2 = dx * dx + dy * dy;
+	if (dist2 > rsum * rsum) {
+		return 0;
+	}
+	int64_t dist = isqrt64(dist2);
+	// Unit normal scaled by FIXED_FRACTION, so only these two divisions depend on the pair
+	int64_t nx, ny;
+	if (dist >= (int64_t)(DIST_EPSILON * (1 << FIXED_SHIFT))) {
+		nx = dx * FIXED_FRACTION / dist;
+		ny = dy * FIXED_FRACTION / dist;
+	} else {
+		nx = 0;
+		ny = FIXED_FRACTION;
+	}
+
+	int64_t overlap = rsum - dist;
+	int64_t sep = (int64_t)(SEP_FACTOR * FIXED_FRACTION + 0.5f) * overlap;
+	int64_t sepx = sep * nx / ((int64_t)FIXED_FRACTION * FIXED_FRACTION);
+	int64_t sepy = sep * ny / ((int64_t)FIXED_FRACTION * FIXED_FRACTION);
+	d[0] = sepx;
+	d[1] = sepy;
+	// Without an impulse the previous position stays, so the separation also adds velocity
+	d[2] = 0;
+	d[3] = 0;
+
+	int64_t vrelx = ((int64_t)curr1[0] - prev1[0]) - ((int64_t)curr2[0] - prev2[0]);
+	int64_t vrely = ((int64_t)curr1[1] - prev1[1]) - ((int64_t)curr2[1] - prev2[1]);
+	int64_t vreln = (vrelx * nx + vrely * ny) / FIXED_FRACTION;
+
+	if (vreln < 0) {
+		int64_t impulse = -(int64_t)((1.0f + RESTITUTION) * 0.5f * FIXED_FRACTION + 0.5f) * vreln / FIXED_FRACTION;
+		d[2] = sepx - impulse * nx / FIXED_FRACTION;
+		d[3] = sepy - impulse * ny / FIXED_FRACTION;
+	}
+	return 1;
+}
+#else
+static inline int contactCorrection(const pos_t* curr1, const pos_t* prev1, const pos_t* curr2, const pos_t* prev2, real_t radii, real_t d[4]) {
+	// Correction of the first particle's position and previous position, the second one gets -d.
+	// radii is the sum of both radii, the distance at which they touch.
+	// Differences are taken at storage precision, only the small results are rounded to real_t
+	real_t vx1 = curr1[0] - prev1[0];
+	real_t vy1 = curr1[1] - prev1[1];
+	real_t vx2 = curr2[0] - prev2[0];
+	real_t vy2 = curr2[1] - prev2[1];
+	real_t dx = curr1[0] - curr2[0];
+	real_t dy = curr1[1] - curr2[1];
+	real_t rsum = radii;
+	real_t rsum2 = rsum * rsum;
+	real_t dist2 = dx * dx + dy * dy;
+	if (dist2 > rsum2) {
+		return 0;
+	}
+	real_t dist = SQRT(dist2);
+	real_t nx, ny;
+	if (dist >= DIST_EPSILON) {
+		nx = dx / dist;
+		ny = dy / dist;
+	} else {
+		nx = 0.0f;
+		ny = 1.0f;
+		// printf("Division by near-zero value! (%f)\n", dist);
+		// return;
+	}
+
+	real_t overlap = rsum - dist;
+
+	real_t sepx = SEP_FACTOR * overlap * nx;
+	real_t sepy = SEP_FACTOR * overlap * ny;
+	d[0] = sepx;
+	d[1] = sepy;
+	// Without an impulse the previous position stays, so the separation also adds velocity
+	d[2] = 0.0f;
+	d[3] = 0.0f;
+
+	real_t vrelx = vx1 - vx2;
+	real_t vrely = vy1 - vy2;
+	real_t vreln = vrelx * nx + vrely * ny;
+
+	if (vreln < 0.0f) {
+		real_t impulse = -(1.0f + RESTITUTION) * vreln * 0.5f;
+		d[2] = sepx - impulse * nx;
+		d[3] = sepy - impulse * ny;
+	}
+	return 1;
+}
+#endif
+
+static inline void collidePair(pos_t* curr1, pos_t* prev1, pos_t* curr2, pos_t* prev2, real_t radii) {
+	real_t d[4];
+	if (contactCorrection(curr1, prev1, curr2, prev2, radii, d)) {
+		curr1[0] += d[0];
+		curr1[1] += d[1];
+		prev1[0] += d[2];
+		prev1[1] += d[3];
+		curr2[0] -= d[0];
+		curr2[1] -= d[1];
+		prev2[0] -= d[2];
+		prev2[1] -= d[3];
+	}
+}
+
+void collideParticles(int i, int j) {
+	pos_t prev[2][2];
+	loadPrev(i, prev[0]);
+	loadPrev(j, prev[1]);
+#if LOCAL_COORDS
+	// Resolve in the frame of i, neighbours are at most a cell or two apart so the shift stays small
+	pos_t shift[2];
+	pos_t curr[2];
+	for (int a = 0; a < 2; a++) {
+		shift[a] = (particles.origin[j][a] - particles.origin[i][a]) * CELL_EDGE;
+		curr[a] = particles.curr[j][a] + shift[a];
+		prev[1][a] += shift[a];
+	}
+	collidePair(particles.curr[i], prev[0], curr, prev[1], particles.radius[i] + particles.radius[j]);
+	for (int a = 0; a < 2; a++) {
+		particles.curr[j][a] = curr[a] - shift[a];
+		prev[1][a] -= shift[a];
+	}
+#else
+	collidePair(particles.curr[i], prev[0], particles.curr[j], prev[1], particles.radius[i] + particles.radius[j]);
+#endif
+	storePrev(i, prev[0]);
+	storePrev(j, prev[1]);
+}
+
+int occupiedColumns(int y, int x0, int x1, int* columns) {
+	// Columns of the occupied cells in row y between x0 and x1, found through the occupancy bits
+	int n = 0;
+#if GRID_MORTON
+	for (int x = x0; x <= x1; x++) {
+		if (cellOccupied(cellIndex(x, y))) {
+			columns[n++] = x;
+		}
+	}
+#else
+	int first = cellIndex(x0, y);
+	int last = cellIndex(x1, y);
+	for (int w = first >> 6; w <= last >> 6; w++) {
+		uint64_t bits = grid.occupied[w];
+		if (w == first >> 6) {
+			bits &= ~(uint64_t)0 << (first & 63);
+		}
+		if (w == last >> 6) {
+			bits &= ~(uint64_t)0 >> (63 - (last & 63));
+		}
+		for (; bits; bits &= bits - 1) {
+			columns[n++] = (w << 6) + __builtin_ctzll(bits) - y * GRID_WIDTH;
+		}
+	}
+#endif
+	return n;
+}
+
+void collideNeighbourLists(int y, int x0, int x1) {
+	int columns[GRID_WIDTH];
+	int n = occupiedColumns(y, x0, x1, columns);
+	for (int k = 0; k < n; k++) {
+		int c = cellIndex(columns[k], y);
+		int count = cellCount(c);
+		for (int ci = 0; ci < count; ci++) {
+			int i = grid.keys[c * grid.cap + ci];
+			for (int l = neighbours.start[i]; l < neighbours.start[i + 1]; l++) {
+				collideParticles(i, neighbours.keys[l]);
+			}
+		}
+	}
+}
+
+void collideTile(int x0, int y0, int x1, int y1) {
+	// Gather the tile and a halo of CELL_REACH cells into local copies once, resolve the window
+	// around every centre there with unit-stride access, then scatter the results back
+	int centres[TILE_WIDTH * TILE_HEIGHT][2];
+	int numCentres = 0;
+	for (int y = y0; y <= y1; y++) {
+		int columns[TILE_WIDTH];
+		int n = occupiedColumns(y, x0, x1, columns);
+		for (int k = 0; k < n; k++) {
+			if (grid.awake[cellIndex(columns[k], y)]) {
+				centres[numCentres][0] = columns[k];
+				centres[numCentres][1] = y;
+				numCentres++;
+			}
+		}
+	}
+	if (numCentres == 0) {
+		return;
+	}
+
+	int hx0 = x0 > CELL_REACH ? x0 - CELL_REACH : 0;
+	int hy0 = y0 > CELL_REACH ? y0 - CELL_REACH : 0;
+	int hx1 = x1 < GRID_WIDTH - 1 - CELL_REACH ? x1 + CELL_REACH : GRID_WIDTH - 1;
+	int hy1 = y1 < GRID_HEIGHT - 1 - CELL_REACH ? y1 + CELL_REACH : GRID_HEIGHT - 1;
+	int w = hx1 - hx0 + 1;
+	int size = (TILE_WIDTH + 2 * CELL_REACH) * (TILE_HEIGHT + 2 * CELL_REACH) * grid.cap;
+	int keys[size];
+	pos_t curr[size][2];
+	pos_t prev[size][2];
+	real_t radius[size];
+	int cellStart[(TILE_WIDTH + 2 * CELL_REACH) * (TILE_HEIGHT + 2 * CELL_REACH) + 1];
+	int count = 0;
+	for (int y = hy0; y <= hy1; y++) {
+		for (int x = hx0; x <= hx1; x++) {
+			cellStart[(y - hy0) * w + x - hx0] = count;
+			int c = cellIndex(x, y);
+			int n = cellCount(c);
+			for (int ci = 0; ci < n; ci++) {
+				int k = grid.keys[c * grid.cap + ci];
+				keys[count] = k;
+				curr[count][0] = particles.curr[k][0];
+				curr[count][1] = particles.curr[k][1];
+				loadPrev(k, prev[count]);
+				radius[count] = particles.radius[k];
+				count++;
+			}
+		}
+	}
+	cellStart[(hy1 - hy0 + 1) * w] = count;
+
+	for (int k = 0; k < numCentres; k++) {
+		int x = centres[k][0];
+		int y = centres[k][1];
+		int cx0 = (x - hx0 > CELL_REACH ? x - CELL_REACH : hx0) - hx0;
+		int cx1 = (hx1 - x > CELL_REACH ? x + CELL_REACH : hx1) - hx0;
+		// Each row of the window is one contiguous segment of the local copies
+		int segStart[2 * CELL_REACH + 1];
+		int segEnd[2 * CELL_REACH + 1];
+		int segs = 0;
+		for (int cy = (y - hy0 > CELL_REACH ? y - CELL_REACH : hy0) - hy0; cy <= (hy1 - y > CELL_REACH ? y + CELL_REACH : hy1) - hy0; cy++) {
+			segStart[segs] = cellStart[cy * w + cx0];
+			segEnd[segs] = cellStart[cy * w + cx1 + 1];
+			segs++;
+		}
+		for (int s = 0; s < segs; s++) {
+			for (int i = segStart[s]; i < segEnd[s]; i++) {
+				for (int j = i + 1; j < segEnd[s]; j++) {
+					collidePair(curr[i], prev[i], curr[j], prev[j], radius[i] + radius[j]);
+				}
+				for (int t = s + 1; t < segs; t++) {
+					for (int j = segStart[t]; j < segEnd[t]; j++) {
+						collidePair(curr[i], prev[i], curr[j], prev[j], radius[i] + radius[j]);
+					}
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		int k = keys[i];
+		particles.curr[k][0] = curr[i][0];
+		particles.curr[k][1] = curr[i][1];
+		storePrev(k, prev[i]);
+	}
+}
+
+static inline void collideRange(int i, int k0, int k1) {
+	for (int k = k0; k < k1; k++) {
+		collideParticles(i, multiGrid.keys[k]);
+	}
+}
+
+void collideLevels(int x0, int y0, int x1, int y1) {
+	// Every particle whose cell lies in the tile, against its own level and then each coarser one.
+	// A coarse cell covers the reach of any finer particle, so queries never go to finer levels.
+	for (int l = 0; l < multiGrid.count; l++) {
+		if (!multiGrid.population[l]) {
+			continue;
+		}
+		int width = GRID_WIDTH << l;
+		int* start = multiGrid.start[l];
+		for (int y = y0 << l; y < (y1 + 1) << l; y++) {
+			for (int k = start[y * width + (x0 << l)]; k < start[y * width + ((x1 + 1) << l)]; k++) {
+				int i = multiGrid.keys[k];
+				int x = multiGrid.cell[i] - y * width;
+				int left = x > CELL_REACH ? x - CELL_REACH : 0;
+				int right = x < width - 1 - CELL_REACH ? x + CELL_REACH : width - 1;
+				// Half of the window: the rest of this cell and the cells right of it, then the rows below
+				collideRange(i, k + 1, start[y * width + right + 1]);
+				for (int ny = y + 1; ny <= y + CELL_REACH && ny < width; ny++) {
+					collideRange(i, start[ny * width + left], start[ny * width + right + 1]);
+				}
+				for (int lc = l - 1; lc >= 0; lc--) {
+					if (!multiGrid.population[lc]) {
+						continue;
+					}
+					int cw = GRID_WIDTH << lc;
+					int cx = x >> (l - lc);
+					int cy = y >> (l - lc);
+					int cl = cx > CELL_REACH ? cx - CELL_REACH : 0;
+					int cr = cx < cw - 1 - CELL_REACH ? cx + CELL_REACH : cw - 1;
+					for (int ny = cy > CELL_REACH ? cy - CELL_REACH : 0; ny <= cy + CELL_REACH && ny < cw; ny++) {
+						collideRange(i, multiGrid.start[lc][ny * cw + cl], multiGrid.start[lc][ny * cw + cr + 1]);
+					}
+				}
+			}
+		}
+	}
+}
+
+void* collisionThread(void* arg) {
+    int threadID = *(int*)arg;
+	int x0 = threadRegion[threadID][0];
+	int x1 = threadRegion[threadID][1];
+	int y0 = threadRegion[threadID][2];
+	int y1 = threadRegion[threadID][3];
+	int mx = x0 + (x1 - x0) / 2;
+	int my = y0 + (y1 - y0) / 2;
+	switch (threadPass) {
+		case 0: { x1 = mx; y1 = my; break; } // top left
+		case 1: { x0 = mx + 1; y1 = my; break; } // top right
+		case 2: { x1 = mx; y0 = my + 1; break; } // bottom left
+		case 3: { x0 = mx + 1; y0 = my + 1; break; } // bottom right
+	}
+	// printf("Thread %d started on region (x0: %d, y0: %d) to (x1: %d, y1: %d)\n", threadID, x0, y0, x1, y1);
+	// Border cells are visited too, since an empty inner neighbour no longer covers them
+	x0 = x0 == 1 ? 0 : x0;
+	y0 = y0 == 1 ? 0 : y0;
+	x1 = x1 == GRID_WIDTH - 2 ? GRID_WIDTH - 1 : x1;
+	y1 = y1 == GRID_HEIGHT - 2 ? GRID_HEIGHT - 1 : y1;
+	// Visit only occupied cells, pairs around an empty cell are covered by their own cells
+	for (int y = y0; y <= y1; y++) {
+		collideNeighbourLists(y, x0, x1);
+	}
+	// pthread_exit(NULL);
+	return NULL;
+}
+
+int tileRowsBefore(int y, int oy, int side, int ny) {
+	// Tile rows of one colour that start above grid row y
+	int rows = 0;
+	while (rows < ny && (oy + side * rows) * TILE_HEIGHT < y) {
+		rows++;
+	}
+	return rows;
+}
+
+void* tileCollisionThread(void* arg) {
+	int threadID = *(int*)arg;
+	// Tiles are coloured by their position modulo side, so tiles of one colour are a whole tile apart
+	int side = TILE_COLOURS == 9 ? 3 : 2;
+	int ox = schedule.colour % side;
+	int oy = schedule.colour / side;
+	int nx = ((GRID_WIDTH + TILE_WIDTH - 1) / TILE_WIDTH - ox + side - 1) / side;
+	int ny = ((GRID_HEIGHT + TILE_HEIGHT - 1) / TILE_HEIGHT - oy + side - 1) / side;
+	int bands = numa.count > 1 ? numa.count : 1;
+	for (int b = 0; b < bands; b++) {
+		// Take tiles from the band on the thread's own node first, then help with the others
+		int band = (numa.band[threadID] + b) % bands;
+		int first = nx * tileRowsBefore(gridBandStart(band), oy, side, ny);
+		int last = nx * tileRowsBefore(gridBandStart(band + 1), oy, side, ny);
+		for (;;) {
+			int k = first + __atomic_fetch_add(&schedule.next[band], 1, __ATOMIC_RELAXED);
+			if (k >= last) {
+				break;
+			}
+			int x0 = (ox + side * (k % nx)) * TILE_WIDTH;
+			int y0 = (oy + side * (k / nx)) * TILE_HEIGHT;
+			int x1 = x0 + TILE_WIDTH - 1 < GRID_WIDTH - 1 ? x0 + TILE_WIDTH - 1 : GRID_WIDTH - 1;
+			int y1 = y0 + TILE_HEIGHT - 1 < GRID_HEIGHT - 1 ? y0 + TILE_HEIGHT - 1 : GRID_HEIGHT - 1;
+			schedule.tile(x0, y0, x1, y1);
+		}
+	}
+	return NULL;
+}
+
+static inline uint32_t radixKey(float v) {
+	// Float bits reordered so unsigned comparison matches float comparison
+	uint32_t u;
+	memcpy(&u, &v, sizeof(u));
+	return u >> 31 ? ~u : u | 0x80000000u;
+}
+
+void radixSortSweep(void) {
+	// Four passes of eight bits, the even number of passes leaves the result in place
+	int* order = sweep.order;
+	float* lo = sweep.lo;
+	int* tempOrder = sweep.tempOrder;
+	float* tempLo = sweep.tempLo;
+	for (int shift = 0; shift < 32; shift += 8) {
+		int count[257] = { 0 };
+		for (int k = 0; k < NUM_PARTICLES; k++) {
+			count[(radixKey(lo[k]) >> shift & 255) + 1]++;
+		}
+		for (int d = 0; d < 256; d++) {
+			count[d + 1] += count[d];
+		}
+		for (int k = 0; k < NUM_PARTICLES; k++) {
+			int m = count[radixKey(lo[k]) >> shift & 255]++;
+			tempOrder[m] = order[k];
+			tempLo[m] = lo[k];
+		}
+		int* swapOrder = order;
+		order = tempOrder;
+		tempOrder = swapOrder;
+		float* swapLo = lo;
+		lo = tempLo;
+		tempLo = swapLo;
+	}
+	sweep.radixSorts++;
+}
+
+void sortSweep(void) {
+	// Refresh the left edges in last step's order, which particles have barely moved out of
+	for (int k = 0; k < NUM_PARTICLES; k++) {
+		int i = sweep.order[k];
+		sweep.lo[k] = TO_FLOAT(particles.curr[i][0]) - TO_FLOAT(particles.radius[i]);
+	}
+	// Insertion sort while it stays cheap, a radix sort when the order is too far off
+	long budget = sweep.sorted ? (long)SWEEP_MAX_MOVES * NUM_PARTICLES : 0;
+	long moves = 0;
+	for (int k = 1; k < NUM_PARTICLES && moves <= budget; k++) {
+		float v = sweep.lo[k];
+		int key = sweep.order[k];
+		int m = k;
+		while (m > 0 && sweep.lo[m - 1] > v) {
+			sweep.lo[m] = sweep.lo[m - 1];
+			sweep.order[m] = sweep.order[m - 1];
+			m--;
+		}
+		sweep.lo[m] = v;
+		sweep.order[m] = key;
+		moves += k - m;
+	}
+	sweep.moves += moves;
+	if (moves > budget) {
+		radixSortSweep();
+	}
+	sweep.sorted = 1;
+	for (int k = 0; k < NUM_PARTICLES; k++) {
+		int i = sweep.order[k];
+		float r = TO_FLOAT(particles.radius[i]);
+		float y = TO_FLOAT(particles.curr[i][1]);
+		sweep.hi[k] = sweep.lo[k] + 2.0f * r;
+		sweep.ylo[k] = y - r;
+		sweep.yhi[k] = y + r;
+	}
+
+	// Slabs of equal count, widened until each spans a pair's reach past the end of the one before.
+	// Pairs then only reach from a slab into the next, so slabs of one parity can be swept in parallel.
+	sweep.slabs = 0;
+	sweep.slabStart[0] = 0;
+	while (sweep.slabStart[sweep.slabs] < NUM_PARTICLES) {
+		int first = sweep.slabStart[sweep.slabs];
+		int next = first + (NUM_PARTICLES + SWEEP_SLABS - 1) / SWEEP_SLABS;
+		while (first > 0 && next < NUM_PARTICLES && sweep.lo[next] <= sweep.lo[first - 1] + 2.0f * PARTICLE_RADIUS) {
+			next++;
+		}
+		sweep.slabStart[++sweep.slabs] = next < NUM_PARTICLES ? next : NUM_PARTICLES;
+	}
+}
+
+void sweepSlab(int k0, int k1) {
+	long candidates = 0;
+	unsigned char hit[SWEEP_BATCH];
+	for (int k = k0; k < k1; k++) {
+		int i = sweep.order[k];
+		float hi = sweep.hi[k];
+		float ylo = sweep.ylo[k];
+		float yhi = sweep.yhi[k];
+		// Partners start inside the x interval. Their intervals are tested a batch at a time in a
+		// branch-free loop the compiler vectorises, then only the hits go to the narrow phase.
+		for (int m0 = k + 1; m0 < NUM_PARTICLES && sweep.lo[m0] <= hi; m0 += SWEEP_BATCH) {
+			int n = NUM_PARTICLES - m0 < SWEEP_BATCH ? NUM_PARTICLES - m0 : SWEEP_BATCH;
+			for (int m = 0; m < n; m++) {
+				hit[m] = (sweep.lo[m0 + m] <= hi) & (sweep.ylo[m0 + m] <= yhi) & (sweep.yhi[m0 + m] >= ylo);
+			}
+			for (int m = 0; m < n; m++) {
+				if (hit[m]) {
+					candidates++;
+					collideParticles(i, sweep.order[m0 + m]);
+				}
+			}
+		}
+	}
+	__atomic_fetch_add(&sweep.candidates, candidates, __ATOMIC_RELAXED);
+}
+
+void* sweepCollisionThread(void* arg) {
+	// Slabs of one parity, taken from a shared counter until none are left
+	for (;;) {
+		int s = 2 * __atomic_fetch_add(&schedule.next[0], 1, __ATOMIC_RELAXED) + schedule.colour;
+		if (s >= sweep.slabs) {
+			break;
+		}
+		sweepSlab(sweep.slabStart[s], sweep.slabStart[s + 1]);
+	}
+	return NULL;
+}
+
+static inline int treeLevelStart(int depth) {
+	// Nodes of the complete levels, level by level, each in Z-order
+	return ((1 << 2 * depth) - 1) / 3;
+}
+
+static inline int treeBlock(uint32_t code) {
+	return tree.blockDepth > 0 ? code >> (32 - 2 * tree.blockDepth) : 0;
+}
+
+static inline int boxesOverlap(const float* a, const float* b) {
+	return a[0] <= b[2] && b[0] <= a[2] && a[1] <= b[3] && b[1] <= a[3];
+}
+
+void mergeTreeChildren(int n) {
+	int c = tree.nodes[n].child;
+	float box[4] = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+	tree.nodes[n].start = tree.nodes[c].start;
+	tree.nodes[n].count = 0;
+	for (int q = 0; q < 4; q++) {
+		tree.nodes[n].count += tree.nodes[c + q].count;
+		box[0] = fminf(box[0], tree.nodes[c + q].box[0]);
+		box[1] = fminf(box[1], tree.nodes[c + q].box[1]);
+		box[2] = fmaxf(box[2], tree.nodes[c + q].box[2]);
+		box[3] = fmaxf(box[3], tree.nodes[c + q].box[3]);
+	}
+	memcpy(tree.nodes[n].box, box, sizeof(box));
+}
+
+void buildTreeNode(int n, int depth) {
+	int start = tree.nodes[n].start;
+	int count = tree.nodes[n].count;
+	// Split while the node is crowded and there is a code bit and room left for children
+	int first = -1;
+	if (count > TREE_LEAF_SIZE && depth < TREE_MAX_DEPTH) {
+		first = __atomic_fetch_add(&tree.used, 4, __ATOMIC_RELAXED);
+		first = first + 4 <= tree.capacity ? first : -1;
+	}
+	tree.nodes[n].child = first;
+	if (first < 0) {
+		// A leaf's bounds cover the discs of its particles
+		float box[4] = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (int k = start; k < start + count; k++) {
+			int i = tree.keys[k];
+			float x = TO_FLOAT(particles.curr[i][0]);
+			float y = TO_FLOAT(particles.curr[i][1]);
+			float r = TO_FLOAT(particles.radius[i]);
+			box[0] = fminf(box[0], x - r);
+			box[1] = fminf(box[1], y - r);
+			box[2] = fmaxf(box[2], x + r);
+			box[3] = fmaxf(box[3], y + r);
+		}
+		memcpy(tree.nodes[n].box, box, sizeof(box));
+		return;
+	}
+	// Counting sort of the range into the four quadrants by the next two code bits
+	int shift = 2 * (TREE_MAX_DEPTH - 1 - depth);
+	int offset[4] = { 0 };
+	for (int k = start; k < start + count; k++) {
+		offset[tree.code[tree.keys[k]] >> shift & 3]++;
+	}
+	for (int q = 0, sum = start; q < 4; q++) {
+		tree.nodes[first + q].start = sum;
+		tree.nodes[first + q].count = offset[q];
+		sum += offset[q];
+		offset[q] = tree.nodes[first + q].start;
+	}
+	for (int k = start; k < start + count; k++) {
+		tree.tempKeys[offset[tree.code[tree.keys[k]] >> shift & 3]++] = tree.keys[k];
+	}
+	memcpy(tree.keys + start, tree.tempKeys + start, count * sizeof(int));
+	for (int q = 0; q < 4; q++) {
+		buildTreeNode(first + q, depth + 1);
+	}
+	mergeTreeChildren(n);
+}
+
+void* treeCodeThread(void* arg) {
+	int threadID = *(int*)arg;
+	int i0 = threadID * NUM_PARTICLES / numThreads;
+	int i1 = (threadID + 1) * NUM_PARTICLES / numThreads;
+	int* count = tree.blockCount + threadID * tree.blocks;
+	memset(count, 0, tree.blocks * sizeof(int));
+	for (int i = i0; i < i1; i++) {
+		int qx = (int)((TO_FLOAT(particles.curr[i][0]) - tree.origin[0]) * tree.scale);
+		int qy = (int)((TO_FLOAT(particles.curr[i][1]) - tree.origin[1]) * tree.scale);
+		qx = qx < 0 ? 0 : qx > 0xFFFF ? 0xFFFF : qx;
+		qy = qy < 0 ? 0 : qy > 0xFFFF ? 0xFFFF : qy;
+		tree.code[i] = spreadBits(qx) | spreadBits(qy) << 1;
+		count[treeBlock(tree.code[i])]++;
+	}
+	return NULL;
+}
+
+void* treeScatterThread(void* arg) {
+	int threadID = *(int*)arg;
+	int i0 = threadID * NUM_PARTICLES / numThreads;
+	int i1 = (threadID + 1) * NUM_PARTICLES / numThreads;
+	int* offset = tree.blockCount + threadID * tree.blocks;
+	for (int i = i0; i < i1; i++) {
+		tree.keys[offset[treeBlock(tree.code[i])]++] = i;
 	}
-	grid[y][x].keys[grid[y][x].count++] = key;
+	return NULL;
 }
 
-void collideParticles(int i, int j) {
-	float x1 = particles.curr[i][0];
-	float y1 = particles.curr[i][1];
-	float x2 = particles.curr[j][0];
-	float y2 = particles.curr[j][1];
-	float px1 = particles.prev[i][0];
-	float py1 = particles.prev[i][1];
-	float px2 = particles.prev[j][0];
-	float py2 = particles.prev[j][1];
-	float vx1 = x1 - px1;
-	float vy1 = y1 - py1;
-	float vx2 = x2 - px2;
-	float vy2 = y2 - py2;
-	float dx = x1 - x2;
-	float dy = y1 - y2;
-	float rsum = PARTICLE_RADIUS + PARTICLE_RADIUS;
-	float rsum2 = rsum * rsum;
-	float dist2 = dx * dx + dy * dy;
-	if (dist2 <= rsum2) {
-		float dist = sqrtf(dist2);
-		float nx, ny;
-		if (dist >= DIST_EPSILON) {
-			nx = dx / dist;
-			ny = dy / dist;
-		} else {
-			nx = 0.0f;
-			ny = 1.0f;
-			// printf("Division by near-zero value! (%f)\n", dist);
-			// return;
+void* treeBlockThread(void* arg) {
+	for (;;) {
+		int b = __atomic_fetch_add(&schedule.next[0], 1, __ATOMIC_RELAXED);
+		if (b >= tree.blocks) {
+			break;
 		}
+		buildTreeNode(treeLevelStart(tree.blockDepth) + b, tree.blockDepth);
+	}
+	return NULL;
+}
 
-		float overlap = rsum - dist;
-
-		float sep1x = SEP_FACTOR * overlap * nx;
-		float sep1y = SEP_FACTOR * overlap * ny;
-
-		float sep2x = SEP_FACTOR * overlap * nx;
-		float sep2y = SEP_FACTOR * overlap * ny;
-
-
-		particles.curr[i][0] += sep1x;
-		particles.curr[i][1] += sep1y;
-		particles.curr[j][0] -= sep2x;
-		particles.curr[j][1] -= sep2y;
+void buildTree(void) {
+	// Codes span the bounding square of the centres, so the tree fits the particles whatever the world
+	float lo[2] = { FLT_MAX, FLT_MAX };
+	float hi[2] = { -FLT_MAX, -FLT_MAX };
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		for (int a = 0; a < 2; a++) {
+			lo[a] = fminf(lo[a], TO_FLOAT(particles.curr[i][a]));
+			hi[a] = fmaxf(hi[a], TO_FLOAT(particles.curr[i][a]));
+		}
+	}
+	float side = fmaxf(fmaxf(hi[0] - lo[0], hi[1] - lo[1]), 2.0f * PARTICLE_RADIUS);
+	tree.origin[0] = lo[0];
+	tree.origin[1] = lo[1];
+	tree.scale = 65536.0f / side;
+	// Blocks of one colour are a block apart, which has to exceed a contact's reach from both of them
+	tree.blockDepth = 0;
+	while (tree.blockDepth < TREE_MAX_BLOCK_DEPTH && side / (2 << tree.blockDepth) >= 8.0f * PARTICLE_RADIUS) {
+		tree.blockDepth++;
+	}
+	tree.blocks = 1 << 2 * tree.blockDepth;
+
+	// Sort by block in parallel: per-thread counts, offsets by block then thread, a stable scatter
+	runThreads(treeCodeThread);
+	int top = treeLevelStart(tree.blockDepth);
+	for (int b = 0, sum = 0; b < tree.blocks; b++) {
+		tree.nodes[top + b].start = sum;
+		for (int t = 0; t < numThreads; t++) {
+			int count = tree.blockCount[t * tree.blocks + b];
+			tree.blockCount[t * tree.blocks + b] = sum;
+			sum += count;
+		}
+		tree.nodes[top + b].count = sum - tree.nodes[top + b].start;
+	}
+	runThreads(treeScatterThread);
+	// Threads split whole blocks, then the complete levels above them are merged
+	tree.used = treeLevelStart(tree.blockDepth + 1);
+	schedule.next[0] = 0;
+	runThreads(treeBlockThread);
+	for (int d = tree.blockDepth - 1; d >= 0; d--) {
+		for (int m = 0; m < 1 << 2 * d; m++) {
+			tree.nodes[treeLevelStart(d) + m].child = treeLevelStart(d + 1) + 4 * m;
+			mergeTreeChildren(treeLevelStart(d) + m);
+		}
+	}
+}
 
-		float vrelx = vx1 - vx2;
-		float vrely = vy1 - vy2;
-		float vreln = vrelx * nx + vrely * ny;
+long collideTreeLeaf(int leaf) {
+	long candidates = 0;
+	int start = tree.nodes[leaf].start;
+	int end = start + tree.nodes[leaf].count;
+	for (int a = start; a < end; a++) {
+		for (int b = a + 1; b < end; b++) {
+			collideParticles(tree.keys[a], tree.keys[b]);
+		}
+	}
+	candidates += (long)(end - start) * (end - start - 1) / 2;
+	// Leaves later in Morton order whose bounds overlap, the earlier ones already took their pairs with this one
+	int stack[4 * (TREE_MAX_DEPTH + 1)];
+	int n = 0;
+	stack[n++] = 0;
+	while (n > 0) {
+		int k = stack[--n];
+		if (tree.nodes[k].start + tree.nodes[k].count <= end || !boxesOverlap(tree.nodes[k].box, tree.nodes[leaf].box)) {
+			continue;
+		}
+		if (tree.nodes[k].child >= 0) {
+			for (int q = 0; q < 4; q++) {
+				stack[n++] = tree.nodes[k].child + q;
+			}
+			continue;
+		}
+		const float* box = tree.nodes[k].box;
+		for (int a = start; a < end; a++) {
+			int i = tree.keys[a];
+			// Only particles whose disc reaches the other leaf
+			float x = TO_FLOAT(particles.curr[i][0]);
+			float y = TO_FLOAT(particles.curr[i][1]);
+			float r = TO_FLOAT(particles.radius[i]);
+			if (x + r < box[0] || x - r > box[2] || y + r < box[1] || y - r > box[3]) {
+				continue;
+			}
+			for (int b = tree.nodes[k].start; b < tree.nodes[k].start + tree.nodes[k].count; b++) {
+				collideParticles(i, tree.keys[b]);
+			}
+			candidates += tree.nodes[k].count;
+		}
+	}
+	return candidates;
+}
 
-		if (vreln < 0.0f) {
-			float impulse = -(1.0f + RESTITUTION) * vreln * 0.5f;
-			vx1 += impulse * nx;
-			vy1 += impulse * ny;
-			vx2 -= impulse * nx;
-			vy2 -= impulse * ny;
-			particles.prev[i][0] = particles.curr[i][0] - vx1;
-			particles.prev[i][1] = particles.curr[i][1] - vy1;
-			particles.prev[j][0] = particles.curr[j][0] - vx2;
-			particles.prev[j][1] = particles.curr[j][1] - vy2;
+void* treeCollisionThread(void* arg) {
+	// Blocks of one colour, each with the leaves below it
+	int side = 1 << tree.blockDepth;
+	int half = (side + 1) / 2;
+	int cx = schedule.colour & 1;
+	int cy = schedule.colour >> 1;
+	long candidates = 0;
+	for (;;) {
+		int k = __atomic_fetch_add(&schedule.next[0], 1, __ATOMIC_RELAXED);
+		if (k >= half * half) {
+			break;
+		}
+		int bx = cx + 2 * (k % half);
+		int by = cy + 2 * (k / half);
+		if (bx >= side || by >= side) {
+			continue;
+		}
+		int stack[4 * (TREE_MAX_DEPTH + 1)];
+		int n = 0;
+		stack[n++] = treeLevelStart(tree.blockDepth) + (spreadBits(bx) | spreadBits(by) << 1);
+		while (n > 0) {
+			int node = stack[--n];
+			if (tree.nodes[node].child >= 0) {
+				for (int q = 0; q < 4; q++) {
+					stack[n++] = tree.nodes[node].child + q;
+				}
+			} else if (tree.nodes[node].count > 0) {
+				candidates += collideTreeLeaf(node);
+			}
 		}
 	}
+	__atomic_fetch_add(&tree.candidates, candidates, __ATOMIC_RELAXED);
+	return NULL;
 }
 
-void* collisionThread(void* arg) {
-    int threadID = *(int*)arg;
-	int x0 = threadRegion[threadID][0];
-	int x1 = threadRegion[threadID][1];
-	int y0 = threadRegion[threadID][2];
-	int y1 = threadRegion[threadID][3];
-	int mx = x0 + (x1 - x0) / 2;
-	int my = y0 + (y1 - y0) / 2;
-	switch (threadPass) {
-		case 0: { x1 = mx; y1 = my; break; } // top left
-		case 1: { x0 = mx + 1; y1 = my; break; } // top right
-		case 2: { x1 = mx; y0 = my + 1; break; } // bottom left
-		case 3: { x0 = mx + 1; y0 = my + 1; break; } // bottom right
+void* jacobiCollisionThread(void* arg) {
+	// Read a frozen snapshot and only accumulate corrections, so no thread ever writes a particle.
+	// Every pair is visited once, from the cell above or to the left of the other.
+	int threadID = *(int*)arg;
+	real_t (*delta)[4] = jacobi.delta + threadID * NUM_PARTICLES;
+	memset(delta, 0, NUM_PARTICLES * sizeof(*delta));
+	// Half of the window: the cell itself, the cells right of it, and the rows below
+	int stencil[(2 * CELL_REACH + 1) * (CELL_REACH + 1)][2];
+	int stencilSize = 0;
+	for (int dy = 0; dy <= CELL_REACH; dy++) {
+		for (int dx = dy ? -CELL_REACH : 0; dx <= CELL_REACH; dx++) {
+			stencil[stencilSize][0] = dx;
+			stencil[stencilSize][1] = dy;
+			stencilSize++;
+		}
 	}
-	// printf("Thread %d started on region (x0: %d, y0: %d) to (x1: %d, y1: %d)\n", threadID, x0, y0, x1, y1);
-	for (int y = y0; y <= y1; y++) {
-		for (int x = x0; x <= x1; x++) {
-			int keys[9 * CELL_CAP];
-			int count = 0;
-			for (int dy = -1; dy <= 1; dy++) {
-				for (int dx = -1; dx <= 1; dx++) {
-					for (int ci = 0; ci < grid[y+dy][x+dx].count; ci++) {
-						keys[count++] = grid[y+dy][x+dx].keys[ci];
+	for (;;) {
+		int y = __atomic_fetch_add(&schedule.next[0], 1, __ATOMIC_RELAXED);
+		if (y >= GRID_HEIGHT) {
+			break;
+		}
+		int columns[GRID_WIDTH];
+		int n = occupiedColumns(y, 0, GRID_WIDTH - 1, columns);
+		for (int k = 0; k < n; k++) {
+			int x = columns[k];
+			int c = cellIndex(x, y);
+			int count = cellCount(c);
+			for (int s = 0; s < stencilSize; s++) {
+				int nx = x + stencil[s][0];
+				int ny = y + stencil[s][1];
+				if (nx < 0 || nx >= GRID_WIDTH || ny >= GRID_HEIGHT) {
+					continue;
+				}
+				int nc = cellIndex(nx, ny);
+				if (!grid.awake[c] && !grid.awake[nc]) {
+					continue;
+				}
+				int ncount = cellCount(nc);
+				for (int ci = 0; ci < count; ci++) {
+					int i = grid.keys[c * grid.cap + ci];
+					for (int cj = s == 0 ? ci + 1 : 0; cj < ncount; cj++) {
+						int j = grid.keys[nc * grid.cap + cj];
+						real_t d[4];
+						pos_t prev[2][2];
+						loadPrev(i, prev[0]);
+						loadPrev(j, prev[1]);
+						if (contactCorrection(particles.curr[i], prev[0], particles.curr[j], prev[1], particles.radius[i] + particles.radius[j], d)) {
+							for (int e = 0; e < 4; e++) {
+								delta[i][e] += d[e];
+								delta[j][e] -= d[e];
+							}
+						}
 					}
 				}
 			}
-			for (int i = 0; i < count - 1; i++) {
-				int key1 = keys[i];
-				for (int j = i + 1; j < count; j++) {
-					int key2 = keys[j];
-					collideParticles(key1, key2);
+		}
+	}
+	return NULL;
+}
+
+void* jacobiApplyThread(void* arg) {
+	int threadID = *(int*)arg;
+	int i0 = threadID * NUM_PARTICLES / numThreads;
+	int i1 = (threadID + 1) * NUM_PARTICLES / numThreads;
+	for (int i = i0; i < i1; i++) {
+		pos_t prev[2];
+		loadPrev(i, prev);
+		for (int t = 0; t < numThreads; t++) {
+			real_t* d = jacobi.delta[t * NUM_PARTICLES + i];
+			particles.curr[i][0] += d[0];
+			particles.curr[i][1] += d[1];
+			prev[0] += d[2];
+			prev[1] += d[3];
+		}
+		storePrev(i, prev);
+	}
+	return NULL;
+}
+
+void* hashCollisionThread(void* arg) {
+	int threadID = *(int*)arg;
+	int bucket = threadPass * numThreads + threadID;
+	for (int k = hashGrid.passStart[bucket]; k < hashGrid.passStart[bucket + 1]; k++) {
+		int x = hashGrid.slots[hashGrid.passSlots[k]].x;
+		int y = hashGrid.slots[hashGrid.passSlots[k]].y;
+		// Cells have no capacity here, so walk the key ranges of the window's cells instead of copying them
+		int start[(2 * CELL_REACH + 1) * (2 * CELL_REACH + 1)];
+		int count[(2 * CELL_REACH + 1) * (2 * CELL_REACH + 1)];
+		int n = 0;
+		for (int dy = -CELL_REACH; dy <= CELL_REACH; dy++) {
+			for (int dx = -CELL_REACH; dx <= CELL_REACH; dx++) {
+				int s = hashFind(x + dx, y + dy);
+				if (s >= 0) {
+					start[n] = hashGrid.slots[s].start;
+					count[n] = hashGrid.slots[s].count;
+					n++;
+				}
+			}
+		}
+		for (int a = 0; a < n; a++) {
+			for (int ai = 0; ai < count[a]; ai++) {
+				int key1 = hashGrid.keys[start[a] + ai];
+				for (int aj = ai + 1; aj < count[a]; aj++) {
+					collideParticles(key1, hashGrid.keys[start[a] + aj]);
+				}
+				for (int b = a + 1; b < n; b++) {
+					for (int bj = 0; bj < count[b]; bj++) {
+						collideParticles(key1, hashGrid.keys[start[b] + bj]);
+					}
 				}
 			}
 		}
 	}
-	// pthread_exit(NULL);
 	return NULL;
 }
 
-int spawnThreadsRecursive(int x0, int x1, int y0, int y1, int subdivs, int axis, int threadID) {
-	if (x1 - x0 + 1 < 3 || y1 - y0 + 1 < 3) {
+int splitRegionsRecursive(int x0, int x1, int y0, int y1, int subdivs, int axis, int threadID) {
+	// Neighbour list pairs reach further than a window, so concurrent quadrants need a wider gap
+	int minSize = options.skin > 0.0f ? 6 * neighbourReach() : 3 * CELL_REACH;
+	if (x1 - x0 + 1 < minSize || y1 - y0 + 1 < minSize) {
 		fprintf(stderr, "Subdivided region too small!\n");
 		exit(1);
 	}
@@ -185,20 +2319,18 @@ int spawnThreadsRecursive(int x0, int x1, int y0, int y1, int subdivs, int axis,
 		threadRegion[threadID][1] = x1;
 		threadRegion[threadID][2] = y0;
 		threadRegion[threadID][3] = y1;
-		threadIDs[threadID] = threadID;
-		// printf("Spawning thread (ID: %d) on region (x0: %d, y0: %d) to (x1: %d, y1: %d)\n", threadID, x0, y0, x1, y1);
-		pthread_create(&threads[threadID], NULL, collisionThread, &threadIDs[threadID]);
+		// printf("Region of thread (ID: %d) is (x0: %d, y0: %d) to (x1: %d, y1: %d)\n", threadID, x0, y0, x1, y1);
 		return 1;
 	}
 	int n = 0;
 	if (axis == 0) {
 		int m = x0 + (x1 - x0) / 2;
-		n += spawnThreadsRecursive(x0, m, y0, y1, subdivs - 1, 1, threadID + n);
-		n += spawnThreadsRecursive(m + 1, x1, y0, y1, subdivs - 1, 1, threadID + n);
+		n += splitRegionsRecursive(x0, m, y0, y1, subdivs - 1, 1, threadID + n);
+		n += splitRegionsRecursive(m + 1, x1, y0, y1, subdivs - 1, 1, threadID + n);
 	} else {
 		int m = y0 + (y1 - y0) / 2;
-		n += spawnThreadsRecursive(x0, x1, y0, m, subdivs - 1, 0, threadID + n);
-		n += spawnThreadsRecursive(x0, x1, m + 1, y1, subdivs - 1, 0, threadID + n);
+		n += splitRegionsRecursive(x0, x1, y0, m, subdivs - 1, 0, threadID + n);
+		n += splitRegionsRecursive(x0, x1, m + 1, y1, subdivs - 1, 0, threadID + n);
 	}
 	return n;
 }
@@ -259,39 +2391,306 @@ void linkShaderProgram(GLuint* program) {
 	}
 }
 
+void initFixedGrid(void) {
+	populateGrid();
+}
+
+void buildFixedGrid(void) {
+	// Populate grid with particles, doubling the cell capacity on overflow
+	// Neighbour lists only need the grid when they are rebuilt
+	int rebuildLists = options.skin > 0.0f && (!neighbours.valid || neighbourListsExpired());
+	if (options.skin <= 0.0f || rebuildLists) {
+		int dropped = options.incremental ? updateGrid() : populateGrid();
+		while (dropped > 0 && resizeGrid(2 * grid.cap)) {
+			gridStats.resizes++;
+			dropped = populateGrid();
+		}
+		gridStats.dropped += dropped;
+		updateAwakeCells();
+	}
+	if (rebuildLists) {
+		buildNeighbourLists();
+	}
+	neighbours.steps++;
+}
+
+int fixedGridPasses(void) {
+	// A collision and an apply phase per Jacobi iteration, four quadrants for neighbour lists, else tile colours
+	return options.jacobi ? 2 * options.jacobi : options.skin > 0.0f ? 4 : TILE_COLOURS;
+}
+
+void collideTiles(int pass, void (*tile)(int x0, int y0, int x1, int y1)) {
+	// The threads take tiles of one colour until none are left
+	schedule.colour = pass;
+	schedule.tile = tile;
+	memset(schedule.next, 0, sizeof(schedule.next));
+	runThreads(tileCollisionThread);
+}
+
+void collideFixedGrid(int pass) {
+	if (options.jacobi) {
+		// Corrections are only applied once every row of the iteration has been collided
+		if (pass % 2 == 0) {
+			schedule.next[0] = 0;
+			runThreads(jacobiCollisionThread);
+		} else {
+			runThreads(jacobiApplyThread);
+		}
+	} else if (options.skin > 0.0f) {
+		// Partition the grid into regions of separate threads
+		threadPass = pass;
+		// Regions are split in halves, so use the largest power of two that fits the threads
+		int subdivs = 0;
+		while (subdivs < MAX_SUBDIVISIONS && 2 << subdivs <= numThreads) {
+			subdivs++;
+		}
+		int regions = splitRegionsRecursive(1, GRID_WIDTH - 2, 1, GRID_HEIGHT - 2, subdivs, 0, 0);
+		// printf("%d regions\n", regions);
+		runWorkers(regions, collisionThread);
+	} else {
+		collideTiles(pass, collideTile);
+	}
+}
+
+void collideLevelTiles(int pass) {
+	collideTiles(pass, collideLevels);
+}
+
+int hashGridPasses(void) {
+	return 4;
+}
+
+void collideHashGrid(int pass) {
+	threadPass = pass;
+	runThreads(hashCollisionThread);
+}
+
+int levelPasses(void) {
+	// Tiles of the coarsest level, every level's pairs stay within CELL_REACH of their tile
+	return TILE_COLOURS;
+}
+
+void initSweep(void) {
+	if (!sweep.order) {
+		sweep.order = arenaAlloc("sweep.order", NUM_PARTICLES * sizeof(int));
+		sweep.lo = arenaAlloc("sweep.lo", NUM_PARTICLES * sizeof(float));
+		sweep.hi = arenaAlloc("sweep.hi", NUM_PARTICLES * sizeof(float));
+		sweep.ylo = arenaAlloc("sweep.ylo", NUM_PARTICLES * sizeof(float));
+		sweep.yhi = arenaAlloc("sweep.yhi", NUM_PARTICLES * sizeof(float));
+		sweep.tempOrder = arenaAlloc("sweep.tempOrder", NUM_PARTICLES * sizeof(int));
+		sweep.tempLo = arenaAlloc("sweep.tempLo", NUM_PARTICLES * sizeof(float));
+	}
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		sweep.order[i] = i;
+	}
+	sweep.sorted = 0;
+}
+
+int sweepPasses(void) {
+	// Even slabs, then odd ones
+	return 2;
+}
+
+void collideSweep(int pass) {
+	schedule.colour = pass;
+	schedule.next[0] = 0;
+	runThreads(sweepCollisionThread);
+}
+
+void initTree(void) {
+	if (!tree.nodes) {
+		tree.capacity = treeLevelStart(TREE_MAX_BLOCK_DEPTH + 1) + 8 * NUM_PARTICLES;
+		tree.nodes = arenaAlloc("tree.nodes", tree.capacity * sizeof(*tree.nodes));
+		tree.code = arenaAlloc("tree.code", NUM_PARTICLES * sizeof(*tree.code));
+		tree.keys = arenaAlloc("tree.keys", NUM_PARTICLES * sizeof(int));
+		tree.tempKeys = arenaAlloc("tree.tempKeys", NUM_PARTICLES * sizeof(int));
+		tree.blockCount = arenaAlloc("tree.blockCount", (size_t)MAX_THREADS * (1 << 2 * TREE_MAX_BLOCK_DEPTH) * sizeof(int));
+	}
+	buildTree();
+}
+
+int treePasses(void) {
+	// Blocks coloured by the parity of both coordinates
+	return 4;
+}
+
+void collideTree(int pass) {
+	schedule.colour = pass;
+	schedule.next[0] = 0;
+	runThreads(treeCollisionThread);
+}
+
+static const broadphase_t broadphases[BROADPHASE_COUNT] = {
+	[BROADPHASE_GRID] = { "grid", initFixedGrid, buildFixedGrid, fixedGridPasses, collideFixedGrid, printFixedGridStats, 1, 1 },
+	[BROADPHASE_HASH] = { "hash", buildHashGrid, buildHashGrid, hashGridPasses, collideHashGrid, printHashStats, 0, 0 },
+	[BROADPHASE_LEVELS] = { "levels", initLevels, buildLevels, levelPasses, collideLevelTiles, printLevelStats, 0, 1 },
+	[BROADPHASE_SWEEP] = { "sweep", initSweep, sortSweep, sweepPasses, collideSweep, printSweepStats, 0, 0 },
+	[BROADPHASE_TREE] = { "tree", initTree, buildTree, treePasses, collideTree, printTreeStats, 0, 0 },
+};
+
+void printGridStats(void) {
+	broadphases[options.broadphase].printStats(gridStats.steps > 0 ? gridStats.steps : 1);
+	resetGridStats();
+}
+
 void initSimulation(void) {
+	if (!particles.curr) {
+		particles.curr = arenaAlloc("particles.curr", NUM_PARTICLES * sizeof(*particles.curr));
+#if COMPACT_STATE
+		particles.velocity = arenaAlloc("particles.velocity", NUM_PARTICLES * sizeof(*particles.velocity));
+#else
+		particles.prev = arenaAlloc("particles.prev", NUM_PARTICLES * sizeof(*particles.prev));
+#endif
+#if LOCAL_COORDS
+		particles.origin = arenaAlloc("particles.origin", NUM_PARTICLES * sizeof(*particles.origin));
+#endif
+		particles.radius = arenaAlloc("particles.radius", NUM_PARTICLES * sizeof(*particles.radius));
+		particles.cell = arenaAlloc("particles.cell", NUM_PARTICLES * sizeof(*particles.cell));
+		particles.motion = arenaAlloc("particles.motion", NUM_PARTICLES * sizeof(*particles.motion));
+		// Any thread may touch any particle, so spread them over the nodes before first touch
+		if (numa.count > 1) {
+			bindMemory(particles.curr, particleBytes(), MPOL_INTERLEAVE, numa.mask);
+		}
+	}
+	if (options.skin > 0.0f && !neighbours.start) {
+		neighbours.start = arenaAlloc("neighbours.start", (NUM_PARTICLES + 1) * sizeof(int));
+		neighbours.origin = arenaAlloc("neighbours.origin", NUM_PARTICLES * sizeof(*neighbours.origin));
+	}
+#if !FIXED_POINT
+	// Clumps are square lattices of touching particles of the smallest radius, so they hold together
+	// without gravity. Their centres are only drawn when asked for, so other starts stay the same.
+	float clusterCentre[MAX_CLUSTERS][2];
+	int clustered = options.clusters > 0 ? (int)(CLUSTER_FRACTION * NUM_PARTICLES) : 0;
+	int clusterSide = options.clusters > 0 ? (int)ceilf(sqrtf((float)clustered / options.clusters)) : 0;
+	float clusterSpacing = 2.002f * options.minRadius * PARTICLE_RADIUS;
+	float clusterHalf = 0.5f * clusterSide * clusterSpacing;
+	for (int c = 0; c < options.clusters; c++) {
+		// Clumps that overlap would burst, so draw again for a while before giving up
+		float extent = options.world > 0.0f ? options.world : 1.0f;
+		for (int attempt = 0, overlaps = 1; overlaps && attempt < 1000; attempt++) {
+			clusterCentre[c][0] = (extent - clusterHalf) * (2.0f * RANDOM() - 1.0f);
+			clusterCentre[c][1] = (extent - clusterHalf) * (2.0f * RANDOM() - 1.0f);
+			overlaps = 0;
+			for (int o = 0; o < c; o++) {
+				overlaps |= fabsf(clusterCentre[c][0] - clusterCentre[o][0]) < 2.0f * clusterHalf + clusterSpacing
+					&& fabsf(clusterCentre[c][1] - clusterCentre[o][1]) < 2.0f * clusterHalf + clusterSpacing;
+			}
+		}
+	}
+#endif
 	for (int i = 0; i < NUM_PARTICLES; i++) {
-		float x = 2.0f * RANDOM() - 1.0f;
-		float y = 2.0f * RANDOM() - 1.0f;
+#if FIXED_POINT
+		// Integer arithmetic only, so the start only depends on rand()
+		pos_t x = (int64_t)rand() * (2 << FIXED_SHIFT) / RAND_MAX - (1 << FIXED_SHIFT);
+		pos_t y = (int64_t)rand() * (2 << FIXED_SHIFT) / RAND_MAX - (1 << FIXED_SHIFT);
+		pos_t dx = (int64_t)rand() * 2 * TO_POS(0.001) / RAND_MAX - TO_POS(0.001);
+		pos_t dy = (int64_t)rand() * 2 * TO_POS(0.001) / RAND_MAX - TO_POS(0.001);
+		particles.motion[i] = (motion_t)dx * dx + (motion_t)dy * dy;
+#else
+		float extent = options.world > 0.0f ? options.world : 1.0f;
+		float x = extent * (2.0f * RANDOM() - 1.0f);
+		float y = extent * (2.0f * RANDOM() - 1.0f);
 		float dx = 0.001f * (2.0f * RANDOM() - 1.0f);
 		float dy = 0.001f * (2.0f * RANDOM() - 1.0f);
+		particles.motion[i] = dx * dx + dy * dy;
+		if (i < clustered) {
+			// At rest on the clump's lattice, the rest of the particles stay spread out as gas
+			int m = i / options.clusters;
+			x = clusterCentre[i % options.clusters][0] + (m % clusterSide + 0.5f) * clusterSpacing - clusterHalf;
+			y = clusterCentre[i % options.clusters][1] + (m / clusterSide + 0.5f) * clusterSpacing - clusterHalf;
+			dx = 0.0f;
+			dy = 0.0f;
+		}
+#if LOCAL_COORDS
+		// Only the offset within the cell is kept as float, the large part goes into the integer origin
+		particles.origin[i][0] = (int32_t)floorf(x * (1.0f / CELL_EDGE));
+		particles.origin[i][1] = (int32_t)floorf(y * (1.0f / CELL_EDGE));
+		x -= particles.origin[i][0] * CELL_EDGE;
+		y -= particles.origin[i][1] * CELL_EDGE;
+#endif
+#endif
 		particles.curr[i][0] = x;
 		particles.curr[i][1] = y;
-		particles.prev[i][0] = x - dx;
-		particles.prev[i][1] = y - dy;
+		storePrev(i, (pos_t[2]){ x - dx, y - dy });
+		// Radii are only drawn when they vary, so equal radii keep the start of earlier runs
+		real_t rmax = TO_POS(PARTICLE_RADIUS);
+		real_t rmin = TO_POS(options.minRadius * PARTICLE_RADIUS);
+#if FIXED_POINT
+		if (options.bimodal > 0.0f) {
+			particles.radius[i] = rmin < rmax && rand() < options.bimodal * RAND_MAX ? rmin : rmax;
+		} else {
+			particles.radius[i] = rmin < rmax ? rmin + (int64_t)rand() * (rmax - rmin) / RAND_MAX : rmax;
+		}
+#else
+		if (options.bimodal > 0.0f) {
+			particles.radius[i] = rmin < rmax && RANDOM() < options.bimodal ? rmin : rmax;
+		} else {
+			particles.radius[i] = rmin < rmax ? rmin + (rmax - rmin) * RANDOM() : rmax;
+		}
+		if (i < clustered) {
+			particles.radius[i] = rmin;
+		}
+#endif
+		particles.cell[i] = -1;
+	}
+	resizeGrid(CELL_CAP);
+	if (options.jacobi) {
+		arenaFree(jacobi.delta);
+		jacobi.delta = arenaAlloc("jacobi.delta", (size_t)numThreads * NUM_PARTICLES * sizeof(*jacobi.delta));
+		// Each buffer is only written by its own thread
+		for (int t = 0; t < numThreads && numa.count > 1; t++) {
+			bindMemory(jacobi.delta + (size_t)t * NUM_PARTICLES, NUM_PARTICLES * sizeof(*jacobi.delta), MPOL_BIND, 1UL << numa.nodes[numa.band[t]]);
+		}
 	}
+	broadphases[options.broadphase].init();
 }
 
 void updateSimulation(float dt1, float dt2) {
-	// Move with verlet integration
+	// Move with verlet integration, skipping sleeping cells unless the mouse is pulling
+	int mouseDown = mouse[2] != 0.0f || mouse[3] != 0.0f;
+#if FIXED_POINT
+	// The mouse is the only float input, without it every step is integer arithmetic
+	int64_t inertia = llrint(dt1 * FIXED_FRACTION);
+	pos_t fall = TO_POS(-options.gravity * dt2);
+#endif
+	sleepingCount = 0;
 	for (int i = 0; i < NUM_PARTICLES; i++) {
-		float x = particles.curr[i][0];
-		float y = particles.curr[i][1];
-		float px = particles.prev[i][0];
-		float py = particles.prev[i][1];
-		float dx = x - px;
-		float dy = y - py;
+		if (mouseDown) {
+			particles.motion[i] = SLEEP_MOTION;
+		} else if (particles.cell[i] >= 0 && !grid.awake[particles.cell[i]]) {
+			sleepingCount++;
+			continue;
+		}
+		pos_t x = particles.curr[i][0];
+		pos_t y = particles.curr[i][1];
+		pos_t prev[2];
+		loadPrev(i, prev);
+		real_t dx = x - prev[0];
+		real_t dy = y - prev[1];
 		float ax = 0.0f;
 		float ay = 0.0f;
-		ax += mouse[2] * MOUSE_FORCE * (mouse[0] - x);
-		ay += mouse[2] * MOUSE_FORCE * (mouse[1] - y);
-		ax -= mouse[3] * MOUSE_FORCE * (mouse[0] - x);
-		ay -= mouse[3] * MOUSE_FORCE * (mouse[1] - y);
-		ay -= GRAVITY;
-		particles.prev[i][0] = x;
-		particles.prev[i][1] = y;
+		float mx = mouse[0] - TO_FLOAT(x);
+		float my = mouse[1] - TO_FLOAT(y);
+#if LOCAL_COORDS
+		mx -= particles.origin[i][0] * CELL_EDGE;
+		my -= particles.origin[i][1] * CELL_EDGE;
+#endif
+		ax += mouse[2] * MOUSE_FORCE * mx;
+		ay += mouse[2] * MOUSE_FORCE * my;
+		ax -= mouse[3] * MOUSE_FORCE * mx;
+		ay -= mouse[3] * MOUSE_FORCE * my;
+		ay -= options.gravity;
+#if FIXED_POINT
+		particles.curr[i][0] = x + (pos_t)(dx * inertia / FIXED_FRACTION) + (mouseDown ? TO_POS(ax * dt2) : 0);
+		particles.curr[i][1] = y + (pos_t)(dy * inertia / FIXED_FRACTION) + (mouseDown ? TO_POS(ay * dt2) : fall);
+#else
 		particles.curr[i][0] = x + dx*dt1 + ax*dt2;
 		particles.curr[i][1] = y + dy*dt1 + ay*dt2;
+#endif
+		storePrev(i, (pos_t[2]){ x, y });
+#if LOCAL_COORDS
+		rebaseParticle(i);
+#endif
 	};
 
 #if DO_COLLISION
@@ -332,45 +2731,45 @@ void updateSimulation(float dt1, float dt2) {
 	// memcpy(particles.curr, tempCurr, NUM_PARTICLES * sizeof(float[2]));
 	// memcpy(particles.prev, tempPrev, NUM_PARTICLES * sizeof(float[2]));
 
-	// Clear grid
-	for (int y = 0; y < GRID_HEIGHT; y++) {
-		for (int x = 0; x < GRID_WIDTH; x++) {
-			grid[y][x].count = 0;
-		}
-	}
-
-	// Populate grid with particles
-	for (int i = 0; i < NUM_PARTICLES; i++) {
-		float x = particles.curr[i][0];
-		float y = particles.curr[i][1];
-		int cx = (int)((x + 1.0f) * 0.5f * GRID_WIDTH);
-		cx = cx < 0 ? 0 : cx >= GRID_WIDTH ? GRID_WIDTH - 1 : cx;
-		int cy = (int)((y + 1.0f) * 0.5f * GRID_HEIGHT);
-		cy = cy < 0 ? 0 : cy >= GRID_HEIGHT ? GRID_HEIGHT - 1 : cy;
-		cellAppend(i, cx, cy);
+	// Build, then resolve the pairs one pass at a time
+	const broadphase_t* broadphase = &broadphases[options.broadphase];
+	double gridStart = getSeconds();
+	broadphase->build();
+	gridStats.seconds += getSeconds() - gridStart;
+	gridStats.steps++;
+	int passes = broadphase->passes();
+	for (int pass = 0; pass < passes; pass++) {
+		broadphase->collide(pass);
 	}
-
-	// Partition the grid into regions of separate threads
-	for (threadPass = 0; threadPass < 4; threadPass++) {
-		int threadsSpawned = spawnThreadsRecursive(1, GRID_WIDTH - 2, 1, GRID_HEIGHT - 2, SUBDIVISIONS, 0, 0);
-		// printf("%d threads spawned\n", threadsSpawned);
-		// Wait for threads to finish
-		for (int i = 0; i < threadsSpawned; i++) {
-			pthread_join(threads[i], NULL);
-		}
-		// printf("All %d threads are done\n", threadsSpawned);
-	}
-
 #endif
 
 	// Apply constraints
+#if FIXED_POINT
+	pos_t world = TO_POS(1.0f);
+#else
+	float world = options.world > 0.0f ? options.world : INFINITY;
+#endif
 	for (int i = 0; i < NUM_PARTICLES; i++) {
-		float x = particles.curr[i][0];
-		float y = particles.curr[i][1];
-		if (x < -1.0f+PARTICLE_RADIUS) x = -1.0f+PARTICLE_RADIUS;
-		if (y < -1.0f+PARTICLE_RADIUS) y = -1.0f+PARTICLE_RADIUS;
-		if (x > 1.0f-PARTICLE_RADIUS) x = 1.0f-PARTICLE_RADIUS;
-		if (y > 1.0f-PARTICLE_RADIUS) y = 1.0f-PARTICLE_RADIUS;
+		// Each particle stops where its own edge meets the wall
+		pos_t wall = world - particles.radius[i];
+		pos_t x = particles.curr[i][0];
+		pos_t y = particles.curr[i][1];
+		pos_t prev[2];
+		loadPrev(i, prev);
+#if LOCAL_COORDS
+		// The walls in the frame of the particle, exact near a wall however far it is from the centre
+		double ox = particles.origin[i][0] * (double)CELL_EDGE;
+		double oy = particles.origin[i][1] * (double)CELL_EDGE;
+		if (x < -wall - ox) x = -wall - ox;
+		if (y < -wall - oy) y = -wall - oy;
+		if (x > wall - ox) x = wall - ox;
+		if (y > wall - oy) y = wall - oy;
+#else
+		if (x < -wall) x = -wall;
+		if (y < -wall) y = -wall;
+		if (x > wall) x = wall;
+		if (y > wall) y = wall;
+#endif
 		// float dist2 = x * x + y * y;
 		// float dist = sqrtf(dist2);
 		// float maxDist = 0.9f - PARTICLE_RADIUS;
@@ -380,8 +2779,341 @@ void updateSimulation(float dt1, float dt2) {
 		// dist = fmaxf(fminf(dist, maxDist), minDist);
 		// particle.curr[i][0] = nx * dist;
 		// particle.curr[i][1] = ny * dist;
+#if COMPACT_STATE
+		// Moving curr drags the relative prev along, so pack it again against the clamped position
+		if (x != particles.curr[i][0] || y != particles.curr[i][1]) {
+			particles.curr[i][0] = x;
+			particles.curr[i][1] = y;
+			storePrev(i, prev);
+		}
+#else
 		particles.curr[i][0] = x;
 		particles.curr[i][1] = y;
+#endif
+
+		// Average the velocity so a single jolt in a settled pile does not wake it
+		real_t vx = x - prev[0];
+		real_t vy = y - prev[1];
+#if FIXED_POINT
+		particles.motion[i] += ((motion_t)vx * vx + (motion_t)vy * vy - particles.motion[i]) / SLEEP_STEPS;
+#else
+		particles.motion[i] += (vx * vx + vy * vy - particles.motion[i]) * (1.0f / SLEEP_STEPS);
+#endif
+	}
+}
+
+int openCounter(int type, unsigned long long config) {
+	// Hardware event count of this process and the collision threads it spawns
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long long readCounter(int fd) {
+	long long value = 0;
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+		return -1;
+	}
+	return value;
+}
+
+int countPages(void* addr, size_t bytes, int node, int* perNode) {
+	// Ask the kernel where each page of the range lives, returns how many are on the given node
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)addr & ~(page - 1);
+	int local = 0;
+	for (uintptr_t a = start; a < (uintptr_t)addr + bytes; ) {
+		void* pages[256];
+		int status[256];
+		int n = 0;
+		for (; n < 256 && a < (uintptr_t)addr + bytes; n++, a += page) {
+			pages[n] = (void*)a;
+		}
+		if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) != 0) {
+			return -1;
+		}
+		for (int k = 0; k < n; k++) {
+			if (status[k] >= 0 && status[k] < MAX_NODES) {
+				local += status[k] == node;
+				perNode[status[k]]++;
+			}
+		}
+	}
+	return local;
+}
+
+void printPlacement(void) {
+	if (numa.count < 2) {
+		printf("NUMA: threads on one node, no placement\n");
+		return;
+	}
+	int gridLocal = 0;
+	int gridPages = 0;
+	int particlePages[MAX_NODES] = { 0 };
+	for (int b = 0; b < numa.count && !GRID_MORTON; b++) {
+		int perNode[MAX_NODES] = { 0 };
+		int c0 = gridBandStart(b) * GRID_WIDTH;
+		int c1 = gridBandStart(b + 1) * GRID_WIDTH;
+		gridLocal += countPages(grid.keys + (size_t)c0 * grid.cap, (size_t)(c1 - c0) * grid.cap * sizeof(int), numa.nodes[b], perNode);
+		for (int node = 0; node < MAX_NODES; node++) {
+			gridPages += perNode[node];
+		}
+	}
+	countPages(particles.curr, particleBytes(), 0, particlePages);
+	printf("NUMA: grid pages %d on their band's node, %d elsewhere; particle pages per node:", gridLocal, gridPages - gridLocal);
+	for (int b = 0; b < numa.count; b++) {
+		printf(" %d:%d", numa.nodes[b], particlePages[numa.nodes[b]]);
+	}
+	printf("\n");
+}
+
+void printOverlap(void) {
+	// How far the solver is from converged: penetration of every touching pair, in particle radii.
+	// The grid may not have been kept up, so grow it until every particle fits.
+	while (populateGrid() > 0 && resizeGrid(2 * grid.cap)) {
+	}
+	double sum = 0.0;
+	float worst = 0.0f;
+	int contacts = 0;
+	for (int y = 0; y < GRID_HEIGHT; y++) {
+		for (int x = 0; x < GRID_WIDTH; x++) {
+			int c = cellIndex(x, y);
+			for (int dy = 0; dy <= CELL_REACH && y + dy < GRID_HEIGHT; dy++) {
+				for (int dx = dy ? -CELL_REACH : 0; dx <= CELL_REACH; dx++) {
+					if (x + dx < 0 || x + dx >= GRID_WIDTH) {
+						continue;
+					}
+					int nc = cellIndex(x + dx, y + dy);
+					for (int ci = 0; ci < cellCount(c); ci++) {
+						int i = grid.keys[c * grid.cap + ci];
+						for (int cj = nc == c ? ci + 1 : 0; cj < cellCount(nc); cj++) {
+							int j = grid.keys[nc * grid.cap + cj];
+							float ddx = TO_FLOAT(particles.curr[i][0]) - TO_FLOAT(particles.curr[j][0]);
+							float ddy = TO_FLOAT(particles.curr[i][1]) - TO_FLOAT(particles.curr[j][1]);
+							float depth = TO_FLOAT(particles.radius[i] + particles.radius[j]) - sqrtf(ddx * ddx + ddy * ddy);
+							if (depth > 0.0f) {
+								sum += depth;
+								worst = depth > worst ? depth : worst;
+								contacts++;
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	printf("Overlap: %d contacts, mean %.4f, max %.4f radii\n", contacts, contacts ? sum / contacts / PARTICLE_RADIUS : 0.0, worst / PARTICLE_RADIUS);
+}
+
+void runBenchmark(void) {
+	initSimulation();
+	printArena();
+	for (int s = 0; s < options.warmupSteps; s++) {
+		updateSimulation(1.0, options.timestep*options.timestep);
+	}
+	resetGridStats();
+	velocityClamps = 0;
+	long sleeping = 0;
+	// Last level cache misses, and loads served by the local node and by a remote one
+	int counters[3] = {
+		openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+		openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16),
+		openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	};
+	long long counts[3];
+	for (int k = 0; k < 3; k++) {
+		counts[k] = readCounter(counters[k]);
+	}
+	double start = getSeconds();
+	for (int s = 0; s < options.benchSteps; s++) {
+		updateSimulation(1.0, options.timestep*options.timestep);
+		sleeping += sleepingCount;
+	}
+	double elapsed = getSeconds() - start;
+	for (int k = 0; k < 3; k++) {
+		long long end = readCounter(counters[k]);
+		counts[k] = counts[k] >= 0 && end >= 0 ? end - counts[k] : -1;
+		if (counters[k] >= 0) {
+			close(counters[k]);
+		}
+	}
+	printf("%d steps in %.3f s (%.3f ms/step)\n", options.benchSteps, elapsed, 1e3 * elapsed / options.benchSteps);
+	printf("Broadphase: %s, %d passes\n", broadphases[options.broadphase].name, broadphases[options.broadphase].passes());
+	printf("Grid: %dx%d cells of %.2f diameters, %dx%d window, %s layout\n", GRID_WIDTH, GRID_HEIGHT, CELL_EDGE / (2.0f * PARTICLE_RADIUS),
+		2 * CELL_REACH + 1, 2 * CELL_REACH + 1, GRID_MORTON ? "Z-order" : "row-major");
+	if (options.bimodal > 0.0f) {
+		printf("Radii: %.0f%% at %.2f, the rest at 1 times PARTICLE_RADIUS\n", 100.0f * options.bimodal, options.minRadius);
+	} else {
+		printf("Radii: %.2f to 1 times PARTICLE_RADIUS\n", options.minRadius);
+	}
+	printf("Positions: %s%s\n", FIXED_POINT ? "fixed point" : PRECISION == PRECISION_DOUBLE ? "double" : PRECISION == PRECISION_MIXED ? "mixed (double positions, float deltas)" : "float",
+		LOCAL_COORDS ? ", relative to their cell" : "");
+#if COMPACT_STATE
+	size_t stateBytes = sizeof(*particles.curr) + sizeof(*particles.velocity);
+#else
+	size_t stateBytes = sizeof(*particles.curr) + sizeof(*particles.prev);
+#endif
+#if LOCAL_COORDS
+	stateBytes += sizeof(*particles.origin);
+#endif
+	printf("State: %s%zu bytes per particle", COMPACT_STATE ? "compact, " : "", stateBytes);
+	if (COMPACT_STATE) {
+		printf(", %ld velocities clamped", velocityClamps);
+	}
+	printf("\n");
+	if (counts[0] >= 0) {
+		printf("LLC misses: %.1f per step\n", (double)counts[0] / options.benchSteps);
+	} else {
+		printf("LLC misses: n/a\n");
+	}
+	if (counts[1] >= 0 && counts[2] >= 0) {
+		printf("Node loads: %.1f local, %.1f remote per step\n", (double)(counts[1] - counts[2]) / options.benchSteps, (double)counts[2] / options.benchSteps);
+	} else {
+		printf("Node loads: n/a\n");
+	}
+	printPlacement();
+	printf("%.1f%% asleep\n", 100.0 * sleeping / ((double)options.benchSteps * NUM_PARTICLES));
+	printGridStats();
+	// The overlap is counted on the fixed grid, which needs global positions inside [-1, 1]
+	if (options.world == 1.0f && !LOCAL_COORDS) {
+		printOverlap();
+	}
+}
+
+void parseOptions(int argc, char** argv) {
+	options.sleep = DO_SLEEP;
+	options.incremental = GRID_INCREMENTAL;
+	options.timestep = FIXED_TIMESTEP;
+	options.skin = NEIGHBOUR_SKIN * PARTICLE_RADIUS;
+	options.minRadius = 1.0f;
+	options.gravity = GRAVITY;
+	options.world = 1.0f;
+	options.smt = 1;
+	options.pin = 1;
+	options.seed = time(NULL);
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+			options.benchSteps = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
+			options.warmupSteps = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+			options.seed = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--timestep") && i + 1 < argc) {
+			options.timestep = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--skin") && i + 1 < argc) {
+			options.skin = atof(argv[++i]) * PARTICLE_RADIUS;
+		} else if (!strcmp(argv[i], "--broadphase") && i + 1 < argc) {
+			i++;
+			options.broadphase = BROADPHASE_COUNT;
+			for (int b = 0; b < BROADPHASE_COUNT; b++) {
+				if (!strcmp(argv[i], broadphases[b].name)) {
+					options.broadphase = b;
+				}
+			}
+			if (options.broadphase == BROADPHASE_COUNT) {
+				fprintf(stderr, "Unknown broadphase %s, use grid, hash, levels, sweep or tree\n", argv[i]);
+				exit(1);
+			}
+		} else if (!strcmp(argv[i], "--hash")) {
+			options.broadphase = BROADPHASE_HASH;
+		} else if (!strcmp(argv[i], "--min-radius") && i + 1 < argc) {
+			options.minRadius = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--bimodal") && i + 1 < argc) {
+			options.bimodal = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--levels")) {
+			options.broadphase = BROADPHASE_LEVELS;
+		} else if (!strcmp(argv[i], "--sweep")) {
+			options.broadphase = BROADPHASE_SWEEP;
+		} else if (!strcmp(argv[i], "--clusters") && i + 1 < argc) {
+			options.clusters = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--gravity") && i + 1 < argc) {
+			options.gravity = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--world") && i + 1 < argc) {
+			options.world = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--jacobi") && i + 1 < argc) {
+			options.jacobi = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			options.threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--no-smt")) {
+			options.smt = 0;
+		} else if (!strcmp(argv[i], "--no-pin")) {
+			options.pin = 0;
+		} else if (!strcmp(argv[i], "--no-sleep")) {
+			options.sleep = 0;
+		} else if (!strcmp(argv[i], "--incremental")) {
+			options.incremental = 1;
+		} else if (!strcmp(argv[i], "--rebuild")) {
+			options.incremental = 0;
+		} else {
+			fprintf(stderr, "Usage: %s [--bench steps] [--warmup steps] [--seed n] [--timestep dt] [--skin radii] [--broadphase grid|hash|levels|sweep|tree] [--hash] [--levels] [--sweep] [--min-radius fraction] [--bimodal fraction] [--clusters n] [--gravity g] [--world extent] [--jacobi iterations] [--threads n] [--no-smt] [--no-pin] [--no-sleep] [--incremental | --rebuild]\n", argv[0]);
+			exit(1);
+		}
+	}
+	const broadphase_t* broadphase = &broadphases[options.broadphase];
+	// Sleeping needs the fixed grid of every step, which neighbour lists skip
+	if (options.skin > 0.0f || !broadphase->sleeps) {
+		options.sleep = 0;
+	}
+	// Neighbour lists and Jacobi iterations are built on the fixed grid
+	if (options.broadphase != BROADPHASE_GRID && (options.skin > 0.0f || options.jacobi)) {
+		fprintf(stderr, "--skin and --jacobi need the fixed grid, not the %s broadphase\n", broadphase->name);
+		exit(1);
+	}
+	if (options.bimodal < 0.0f || options.bimodal > 1.0f) {
+		fprintf(stderr, "--bimodal must be a fraction between 0 and 1\n");
+		exit(1);
+	}
+	if (options.clusters < 0 || options.clusters > MAX_CLUSTERS) {
+		fprintf(stderr, "--clusters must be between 0 and %d\n", MAX_CLUSTERS);
+		exit(1);
+	}
+	// Clumps are placed with float maths, which the fixed-point start avoids
+	if (FIXED_POINT && options.clusters > 0) {
+		fprintf(stderr, "Fixed-point positions can't start in --clusters\n");
+		exit(1);
+	}
+	if (options.minRadius <= 0.0f || options.minRadius > 1.0f) {
+		fprintf(stderr, "--min-radius must be in (0, 1], PARTICLE_RADIUS is the largest radius\n");
+		exit(1);
+	}
+	// The fixed grids span [-1, 1], anything else needs an unbounded broadphase
+	if (options.world != 1.0f && broadphase->bounded) {
+		fprintf(stderr, "--world other than 1 needs the hash, sweep or tree broadphase\n");
+		exit(1);
+	}
+	if (LOCAL_COORDS && options.broadphase != BROADPHASE_HASH) {
+		fprintf(stderr, "Cell-relative coordinates need the hash broadphase\n");
+		exit(1);
+	}
+	// The other backends compute their cells and sort keys in float, so only the grid stays bit-identical
+	if (FIXED_POINT && (options.broadphase != BROADPHASE_GRID || options.skin > 0.0f)) {
+		fprintf(stderr, "Fixed-point positions need the fixed grid without --skin\n");
+		exit(1);
+	}
+	if (FIXED_POINT && options.world != 1.0f) {
+		fprintf(stderr, "Fixed-point positions only span a --world of 1\n");
+		exit(1);
+	}
+	// Concurrent quadrants are six neighbour reaches apart, which must fit the smallest thread region
+	int width = (GRID_WIDTH - 2) >> (MAX_SUBDIVISIONS + 1) / 2;
+	int height = (GRID_HEIGHT - 2) >> MAX_SUBDIVISIONS / 2;
+	int reach = (width < height ? width : height) / 6;
+	if (options.skin < 0.0f || (options.skin > 0.0f && neighbourReach() > reach)) {
+		fprintf(stderr, "--skin must be between 0 and %.2f radii\n", (reach * CELL_EDGE - 2.0f * PARTICLE_RADIUS) / PARTICLE_RADIUS);
+		exit(1);
+	}
+	if (options.jacobi < 0) {
+		fprintf(stderr, "--jacobi must be 0 or more iterations\n");
+		exit(1);
+	}
+	if (options.jacobi && options.skin > 0.0f) {
+		fprintf(stderr, "--jacobi needs the fixed grid without --skin\n");
+		exit(1);
 	}
 }
 
@@ -390,9 +3122,16 @@ void glfwCursorPosCallback(GLFWwindow* window, double x, double y);
 void glfwMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void glfwFramebufferSizeCallback(GLFWwindow* window, int width, int height);
 
-int main(void) {
+int main(int argc, char** argv) {
+
+	parseOptions(argc, argv);
+	srand(options.seed);
+	setupThreads();
 
-	srand(time(NULL));
+	if (options.benchSteps > 0) {
+		runBenchmark();
+		return 0;
+	}
 
 	glfwInitHint(GLFW_WAYLAND_LIBDECOR, GLFW_WAYLAND_DISABLE_LIBDECOR);
 
@@ -445,24 +3184,32 @@ int main(void) {
 	glDeleteShader(fragmentShader);
 
 	glUseProgram(shaderProgram);
-	glUniform1f(glGetUniformLocation(shaderProgram, "radius"), PARTICLE_RADIUS);
+	glUniform1f(glGetUniformLocation(shaderProgram, "scale"), 1.0f / viewExtent());
 	glUseProgram(0);
 
-	GLuint vao, vbo;
+	// Positions change every frame, radii never do
+	GLuint vao, vbo, radiusVbo;
 	glGenBuffers(1, &vbo);
 	glBindBuffer(GL_ARRAY_BUFFER, vbo);
 	glBufferData(GL_ARRAY_BUFFER, NUM_PARTICLES * sizeof(GLfloat[2]), NULL, GL_DYNAMIC_DRAW);
+	glGenBuffers(1, &radiusVbo);
 
 	glGenVertexArrays(1, &vao);
 	glBindVertexArray(vao);
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
 	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, radiusVbo);
+	glBufferData(GL_ARRAY_BUFFER, NUM_PARTICLES * sizeof(GLfloat), NULL, GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	glEnableVertexAttribArray(1);
 
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
 
 	// glEnable(GL_POINT_SPRITE_NV);
 	glEnable(GL_POINT_SPRITE_ARB);
+	// Sizes come from gl_PointSize, one per particle
+	glEnable(GL_PROGRAM_POINT_SIZE);
 
 	glfwSetTime(0.0);
 	float timePrev = 0.0f;
@@ -475,8 +3222,15 @@ int main(void) {
 	// float timestepTimer = 0.0f;
 
 	initSimulation();
+	printArena();
 
-	printf("Running on %d threads\n", NUM_THREADS);
+	glBindBuffer(GL_ARRAY_BUFFER, radiusVbo);
+	GLfloat* radii = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+	for (int i = 0; i < NUM_PARTICLES; i++) {
+		radii[i] = TO_FLOAT(particles.radius[i]);
+	}
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	while (!glfwWindowShouldClose(window)) {
 
@@ -488,6 +3242,8 @@ int main(void) {
 		deltaTimePrev = deltaTime;
 		if (secTimer >= 1.0f) {
 			printf("%d FPS\n", fpsCounter);
+			printGridStats();
+			printf("%.1f%% asleep\n", 100.0f * sleepingCount / NUM_PARTICLES);
 			fpsCounter = 0;
 			secTimer -= 1.0f;
 		}
@@ -495,11 +3251,28 @@ int main(void) {
 		fpsCounter++;
 
 		// updateSimulation(dt1, dt2);
-		updateSimulation(1.0, FIXED_TIMESTEP*FIXED_TIMESTEP);
+		updateSimulation(1.0, options.timestep*options.timestep);
 
 		// Send particle positions to GPU
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+#if FIXED_POINT || PRECISION != PRECISION_SINGLE || LOCAL_COORDS
+		static GLfloat (*vertices)[2];
+		if (!vertices) {
+			vertices = arenaAlloc("vertices", NUM_PARTICLES * sizeof(*vertices));
+		}
+		for (int i = 0; i < NUM_PARTICLES; i++) {
+#if LOCAL_COORDS
+			vertices[i][0] = particles.origin[i][0] * CELL_EDGE + particles.curr[i][0];
+			vertices[i][1] = particles.origin[i][1] * CELL_EDGE + particles.curr[i][1];
+#else
+			vertices[i][0] = TO_FLOAT(particles.curr[i][0]);
+			vertices[i][1] = TO_FLOAT(particles.curr[i][1]);
+#endif
+		}
+		glBufferSubData(GL_ARRAY_BUFFER, 0, NUM_PARTICLES * sizeof(GLfloat[2]), vertices);
+#else
 		glBufferSubData(GL_ARRAY_BUFFER, 0, NUM_PARTICLES * sizeof(GLfloat[2]), particles.curr);
+#endif
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 		// Make draw call
@@ -507,6 +3280,7 @@ int main(void) {
 		glClear(GL_COLOR_BUFFER_BIT);
 		glBindVertexArray(vao);
 		glUseProgram(shaderProgram);
+		glUniform1f(glGetUniformLocation(shaderProgram, "viewportHeight"), viewport[1]);
 		glDrawArrays(GL_POINTS, 0, NUM_PARTICLES);
 
 		glfwSwapBuffers(window);
@@ -514,6 +3288,7 @@ int main(void) {
 	}
 
 	glDeleteBuffers(1, &vbo);
+	glDeleteBuffers(1, &radiusVbo);
 	glDeleteVertexArrays(1, &vao);
 	glDeleteProgram(shaderProgram);
 
@@ -528,8 +3303,8 @@ void glfwErrorCallback(int code, const char* desc) {
 }
 
 void glfwCursorPosCallback(GLFWwindow* window, double x, double y) {
-	mouse[0] = +(2.0f * (x - viewport[2]) / viewport[0] - 1.0f);
-	mouse[1] = -(2.0f * (y - viewport[3]) / viewport[1] - 1.0f);
+	mouse[0] = +(2.0f * (x - viewport[2]) / viewport[0] - 1.0f) * viewExtent();
+	mouse[1] = -(2.0f * (y - viewport[3]) / viewport[1] - 1.0f) * viewExtent();
 }
 
 void glfwMouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
@@ -571,6 +3346,5 @@ void glfwFramebufferSizeCallback(GLFWwindow* window, int width, int height) {
 	viewport[2] = viewportX;
 	viewport[3] = viewportY;
 	glViewport(viewportX, viewportY, viewportWidth, viewportHeight);
-	glPointSize(PARTICLE_RADIUS * viewport[1]);
 }
 